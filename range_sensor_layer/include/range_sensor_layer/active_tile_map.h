@@ -0,0 +1,49 @@
+#ifndef RANGE_SENSOR_LAYER_ACTIVE_TILE_MAP_H_
+#define RANGE_SENSOR_LAYER_ACTIVE_TILE_MAP_H_
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+class SparseTileGrid;
+
+// Splits the layer grid into square tiles and remembers which of them hold any cell
+// that updateCosts() would write, i.e. a probability above mark or below clear. Tiles
+// touched since the last refresh() are re-evaluated there; all others keep their state.
+class ActiveTileMap
+{
+public:
+  static const unsigned int TILE_SHIFT = 4;  // 16 x 16 cells
+  static const unsigned int TILE_SIZE = 1 << TILE_SHIFT;
+
+  ActiveTileMap();
+
+  void resize(unsigned int size_x, unsigned int size_y);
+  // Cells [x0, x1] of row y changed
+  void markDirty(int y, int x0, int x1);
+  void markAllDirty();
+  // The grid moved so that cell (x, y) now holds what (x + cell_ox, y + cell_oy) did, and
+  // cells from outside were reset
+  void shift(int cell_ox, int cell_oy);
+  // Re-evaluates the dirty tiles over costs, a size_x by size_y array
+  void refresh(const unsigned char* costs, unsigned char clear, unsigned char mark);
+  void refresh(const SparseTileGrid& costs, unsigned char clear, unsigned char mark);
+
+  unsigned int tilesX() const { return tiles_x_; }
+  unsigned int tilesY() const { return tiles_y_; }
+  bool active(unsigned int tx, unsigned int ty) const { return active_[ty * tiles_x_ + tx] != 0; }
+
+private:
+  void beginRefresh(unsigned char clear, unsigned char mark);
+  // Whether any of the width by height cells would be written by updateCosts()
+  bool contributes(const unsigned char* cells, unsigned int stride, unsigned int width, unsigned int height) const;
+
+  unsigned int size_x_, size_y_, tiles_x_, tiles_y_;
+  std::vector<unsigned char> active_, dirty_;
+  std::vector<unsigned int> dirty_list_;
+  bool all_dirty_;
+  int clear_, mark_;
+};
+
+}  // namespace range_sensor_layer
+#endif
@@ -0,0 +1,157 @@
+#ifndef RANGE_SENSOR_LAYER_BOUNDED_QUEUE_H_
+#define RANGE_SENSOR_LAYER_BOUNDED_QUEUE_H_
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_array.hpp>
+#include <vector>
+#include <stddef.h>
+
+namespace range_sensor_layer
+{
+
+// Bounded lock-free queue for copyable items (Vyukov's sequenced ring). Any
+// number of threads may push; the consumer drains it. All storage is allocated up
+// front, and when the queue is full a push either evicts the oldest item or is
+// itself dropped, depending on the overflow policy. Both cases are counted.
+template <typename T>
+class BoundedQueue : private boost::noncopyable
+{
+public:
+  enum OverflowPolicy
+  {
+    DROP_OLDEST,
+    DROP_NEWEST
+  };
+
+  BoundedQueue() : mask_(0), policy_(DROP_OLDEST), enqueue_pos_(0), dequeue_pos_(0), overflows_(0) {}
+
+  // Not thread safe; capacity is rounded up to a power of two
+  void init(size_t capacity, OverflowPolicy policy)
+  {
+    size_t size = 1;
+    while (size < capacity)
+      size <<= 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++)
+      cells_[i].sequence.store(i, boost::memory_order_relaxed);
+    mask_ = size - 1;
+    policy_ = policy;
+    enqueue_pos_.store(0, boost::memory_order_relaxed);
+    dequeue_pos_.store(0, boost::memory_order_relaxed);
+    overflows_.store(0, boost::memory_order_relaxed);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Returns false if the item itself was dropped
+  bool push(const T& item)
+  {
+    while (!tryPush(item))
+    {
+      if (policy_ == DROP_NEWEST)
+      {
+        overflows_.fetch_add(1, boost::memory_order_relaxed);
+        return false;
+      }
+      T oldest;
+      if (tryPop(oldest))
+        overflows_.fetch_add(1, boost::memory_order_relaxed);
+    }
+    return true;
+  }
+
+  bool tryPop(T& item)
+  {
+    size_t pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    Cell* cell;
+    for (;;)
+    {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(boost::memory_order_acquire);
+      ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+      if (dif == 0)
+      {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed))
+          break;
+      }
+      else if (dif < 0)
+        return false;
+      else
+        pos = dequeue_pos_.load(boost::memory_order_relaxed);
+    }
+    item = cell->data;
+    cell->data = T();  // do not keep shared pointers alive in free slots
+    cell->sequence.store(pos + mask_ + 1, boost::memory_order_release);
+    return true;
+  }
+
+  // Appends everything queued so far to items, at most one queue's worth so that
+  // busy producers cannot keep the consumer looping
+  size_t drain(std::vector<T>& items)
+  {
+    size_t n = 0;
+    T item;
+    while (n <= mask_ && tryPop(item))
+    {
+      items.push_back(item);
+      n++;
+    }
+    return n;
+  }
+
+  void clear()
+  {
+    T item;
+    while (tryPop(item))
+      ;
+  }
+
+  // Items lost to overflow since init()
+  unsigned long overflows() const { return overflows_.load(boost::memory_order_relaxed); }
+
+private:
+  struct Cell
+  {
+    boost::atomic<size_t> sequence;
+    T data;
+  };
+
+  bool tryPush(const T& item)
+  {
+    size_t pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    Cell* cell;
+    for (;;)
+    {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(boost::memory_order_acquire);
+      ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)pos;
+      if (dif == 0)
+      {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, boost::memory_order_relaxed))
+          break;
+      }
+      else if (dif < 0)
+        return false;
+      else
+        pos = enqueue_pos_.load(boost::memory_order_relaxed);
+    }
+    cell->data = item;
+    cell->sequence.store(pos + 1, boost::memory_order_release);
+    return true;
+  }
+
+  boost::scoped_array<Cell> cells_;
+  size_t mask_;
+  OverflowPolicy policy_;
+
+  // Producer and consumer positions on separate cache lines
+  char pad0_[64];
+  boost::atomic<size_t> enqueue_pos_;
+  char pad1_[64];
+  boost::atomic<size_t> dequeue_pos_;
+  char pad2_[64];
+  boost::atomic<unsigned long> overflows_;
+};
+
+}  // namespace range_sensor_layer
+#endif
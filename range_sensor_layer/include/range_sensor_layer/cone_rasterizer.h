@@ -0,0 +1,23 @@
+#ifndef RANGE_SENSOR_LAYER_CONE_RASTERIZER_H_
+#define RANGE_SENSOR_LAYER_CONE_RASTERIZER_H_
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+// A run of cells [x0, x1] (inclusive) in row y
+struct CellSpan
+{
+  int y, x0, x1;
+};
+
+// Appends to spans the cells of a size_x by size_y grid whose centers lie inside the
+// circular sector with apex (cx, cy), heading theta, half angle half_angle and the
+// given radius. Positions and radius are in cell units, so cell (i, j) has its center
+// at (i + 0.5, j + 0.5). Spans come out ordered by row; a row holds at most two spans,
+// and two only when half_angle is wider than pi/2.
+void rasterizeCone(double cx, double cy, double theta, double half_angle, double radius,
+                   unsigned int size_x, unsigned int size_y, std::vector<CellSpan>& spans);
+
+}  // namespace range_sensor_layer
+#endif
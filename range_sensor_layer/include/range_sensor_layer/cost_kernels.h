@@ -0,0 +1,16 @@
+#ifndef RANGE_SENSOR_LAYER_COST_KERNELS_H_
+#define RANGE_SENSOR_LAYER_COST_KERNELS_H_
+
+namespace range_sensor_layer
+{
+
+// Merges n layer cells into the master costmap row. Cells whose probability cost is
+// above mark become LETHAL_OBSTACLE, those below clear FREE_SPACE, and NO_INFORMATION
+// or in-between cells are left out. A result is only written where the master cell is
+// NO_INFORMATION or lower. Uses AVX2 or SSE2 when the CPU has them; every variant
+// produces the same output as the scalar loop.
+void mergeThresholdedRow(const unsigned char* layer, unsigned char* master, unsigned int n,
+                         unsigned char clear, unsigned char mark);
+
+}  // namespace range_sensor_layer
+#endif
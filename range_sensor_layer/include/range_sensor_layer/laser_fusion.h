@@ -0,0 +1,62 @@
+#ifndef RANGE_SENSOR_LAYER_LASER_FUSION_H_
+#define RANGE_SENSOR_LAYER_LASER_FUSION_H_
+#include <ros/ros.h>
+#include <sensor_msgs/LaserScan.h>
+#include <tf/transform_listener.h>
+#include <boost/atomic.hpp>
+#include <string>
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+// Decides whether the laser already sees what a range sensor reports. Scans are kept
+// by reference in a short history, so a reading is paired with the scan nearest to it
+// in time. For each sensor, the laser beams that can pass through its field of view
+// are found once from the static laser to sensor transform, and only those beams are
+// examined per reading.
+class LaserFusion
+{
+public:
+  LaserFusion();
+
+  void init(tf::TransformListener* tf, unsigned int history_size, unsigned int max_sensors);
+  // tolerance: slack (m) on the sensor range; ratio: share of the window's beams that
+  // must agree; max_dt: largest stamp difference (s) for pairing a reading with a scan
+  void setParameters(double tolerance, double ratio, double max_dt);
+
+  // Subscriber side; lock free, and the scan is never copied
+  void addScan(const sensor_msgs::LaserScanConstPtr& scan);
+  sensor_msgs::LaserScanConstPtr latestScan() const;
+  sensor_msgs::LaserScanConstPtr closestScan(const ros::Time& stamp) const;
+
+  // True if, in the scan closest to stamp, enough beams crossing the sensor's cone hit
+  // something inside it no farther than range
+  bool confirms(unsigned int sensor, const std::string& sensor_frame, const ros::Time& stamp,
+                float field_of_view, float max_range, float range);
+
+private:
+  struct BeamWindow
+  {
+    bool valid;
+    std::string laser_frame;
+    size_t scan_size;
+    float angle_min, angle_increment, field_of_view, max_range;
+    double lx, ly;       // laser origin in the sensor frame
+    double cos_half_fov;
+    std::vector<unsigned int> beams;
+    std::vector<float> dx, dy;  // beam directions in the sensor frame
+  };
+
+  bool updateWindow(BeamWindow& window, const std::string& sensor_frame, const sensor_msgs::LaserScan& scan,
+                    float field_of_view, float max_range);
+
+  tf::TransformListener* tf_;
+  std::vector<sensor_msgs::LaserScanConstPtr> history_;
+  boost::atomic<unsigned long> scan_count_;
+  std::vector<BeamWindow> windows_;
+  double tolerance_, ratio_, max_dt_;
+};
+
+}  // namespace range_sensor_layer
+#endif
@@ -0,0 +1,52 @@
+#ifndef RANGE_SENSOR_LAYER_LOG_ODDS_GRID_H_
+#define RANGE_SENSOR_LAYER_LOG_ODDS_GRID_H_
+#include <range_sensor_layer/cone_rasterizer.h>
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+// Occupancy grid stored as clamped log-odds, so a Bayesian update is a single add.
+// The costs derived from it are only recomputed for the runs of cells that changed
+// since the last flush().
+class LogOddsGrid
+{
+public:
+  LogOddsGrid();
+
+  void resize(unsigned int size_x, unsigned int size_y);
+  // Sets every cell back to the prior (p = 0.5)
+  void reset();
+
+  // Adds per-cell log-odds to the n cells starting at (x, y). Neither this nor set()
+  // records the change, so rows may be updated from several threads at once; callers
+  // markDirty() the cells they are about to touch instead.
+  void addRow(unsigned int x, unsigned int y, const float* log_odds, unsigned int n);
+  // Same as addRow() with the same log-odds for all n cells
+  void addConstant(unsigned int x, unsigned int y, float log_odds, unsigned int n);
+  // Overwrites one cell with the log-odds of probability p
+  void set(unsigned int x, unsigned int y, double p);
+  // Cells [x0, x1] of row y are to be written out by the next flush()
+  void markDirty(int y, int x0, int x1);
+  // Sets the n cells starting at (x, y) back to the prior, without marking them
+  void clearRow(unsigned int x, unsigned int y, unsigned int n);
+  // Moves the contents by (dx, dy) cells, as Costmap2D::updateOrigin() does; cells
+  // shifted in from outside are reset to the prior
+  void shift(int dx, int dy);
+  // Writes the cost of every cell changed since the last flush into costs, a
+  // size_x by size_y array
+  void flush(unsigned char* costs);
+
+  float logOdds(double p) const;
+  unsigned char cost(float log_odds) const;
+
+private:
+  unsigned int size_x_, size_y_;
+  std::vector<float> cells_;
+  std::vector<CellSpan> dirty_;
+  std::vector<float> logit_table_;
+  std::vector<unsigned char> cost_table_;
+};
+
+}  // namespace range_sensor_layer
+#endif
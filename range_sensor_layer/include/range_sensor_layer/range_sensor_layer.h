@@ -5,12 +5,35 @@
 #include <costmap_2d/layered_costmap.h>
 #include <sensor_msgs/Range.h>
 #include <sensor_msgs/LaserScan.h>
+#include <tf/transform_listener.h>
 #include <range_sensor_layer/RangeSensorLayerConfig.h>
+#include <range_sensor_layer/active_tile_map.h>
+#include <range_sensor_layer/cone_rasterizer.h>
+#include <range_sensor_layer/cost_kernels.h>
+#include <range_sensor_layer/log_odds_grid.h>
+#include <range_sensor_layer/sparse_tile_grid.h>
+#include <range_sensor_layer/bounded_queue.h>
+#include <range_sensor_layer/laser_fusion.h>
+#include <range_sensor_layer/scan_beams.h>
+#include <range_sensor_layer/worker_pool.h>
 #include <dynamic_reconfigure/server.h>
 
 namespace range_sensor_layer
 {
 
+// Compact copy of a sensor_msgs::Range, with the frame id replaced by an index into
+// the layer's table of sensor frames
+struct RangeReading
+{
+  ros::Time stamp;
+  unsigned int sensor;
+  float field_of_view;
+  float min_range;
+  float max_range;
+  float range;
+  unsigned int weight;  // readings coalesced into this one
+};
+
 class RangeSensorLayer : public costmap_2d::CostmapLayer
 {
 public:
@@ -22,6 +45,7 @@ public:
   };
 
   RangeSensorLayer();
+  virtual ~RangeSensorLayer();
 
   virtual void onInitialize();
   virtual void updateBounds(double robot_x, double robot_y, double robot_yaw, double* min_x, double* min_y, double* max_x,
@@ -30,47 +54,230 @@ public:
   virtual void reset();
   virtual void deactivate();
   virtual void activate();
+  virtual void matchSize();
+  virtual void updateOrigin(double new_origin_x, double new_origin_y);
+
+  // Tiles holding observed cells with sparse_storage
+  unsigned int getAllocatedTiles() const { return sparse_costs_.allocatedTiles(); }
+
+  // Readings put back or given up on during the last updateBounds() because their
+  // transform was not available yet
+  unsigned int getDeferredReadings() const { return deferred_readings_; }
+  unsigned int getDroppedReadings() const { return dropped_readings_; }
+  // Readings lost to a full incoming queue during the last updateBounds()
+  unsigned long getOverflowedReadings() const { return overflowed_readings_; }
+  // Readings folded into an earlier one of the same sensor during the last updateBounds()
+  unsigned int getCoalescedReadings() const { return coalesced_readings_; }
+
+protected:
+  virtual void initMaps(unsigned int size_x, unsigned int size_y);
+  virtual void resetMaps();
 
 private:
-  void syncCB(const sensor_msgs::Range& range_message);
   void reconfigureCB(range_sensor_layer::RangeSensorLayerConfig &config, uint32_t level);
   void bufferIncomingScanMsg(const sensor_msgs::LaserScanConstPtr& scan_message);
   void bufferIncomingRangeMsg(const sensor_msgs::RangeConstPtr& range_message);
-  void processRangeMsg(sensor_msgs::Range& range_message);
-  void processFixedRangeMsg(sensor_msgs::Range& range_message);
-  void processVariableRangeMsg(sensor_msgs::Range& range_message);
+  void processRangeMsg(RangeReading& range_message);
+  void processFixedRangeMsg(RangeReading& range_message);
+  void processVariableRangeMsg(RangeReading& range_message);
 
   void updateCostmap();
-  void updateCostmap(sensor_msgs::Range& range_message, bool clear_sensor_cone);
+  void integrationLoop();
+  void coalesceReadings(std::vector<RangeReading>& readings);
+  // Cells [x0, x1] of map row y as at most two runs in storage (see toroidal_storage_)
+  unsigned int storageRuns(int y, int x0, int x1, CellSpan runs[2]) const;
+  void markDirty(int y, int x0, int x1);
+  // Resets map rows [y0, y1), columns [x0, x1) to the prior
+  void clearMapRows(int y0, int y1, int x0, int x1);
+  void rotateOrigin(double new_origin_x, double new_origin_y);
+  // Byte cells from storage (x, y) on: at most *n of them, which may be cut short at a
+  // sparse tile edge, and a read-only view that runs to the next tile edge at least
+  unsigned char* storageCells(unsigned int x, unsigned int y, unsigned int* n);
+  const unsigned char* storageRow(unsigned int x, unsigned int y) const;
+  // Applies the cones gathered this cycle, on the worker pool when there is one
+  void integrateCones();
+  void integrateCones(unsigned int worker, unsigned int workers);
+  // Laser scans as observations: free space along each beam, a hit at its end
+  void integrateScans(const ros::Time& now);
+  void integrateScan(const sensor_msgs::LaserScan& scan);
+  void traceBeam(int x0, int y0, int x1, int y1, bool hit);
+  void updateScanCell(int x, int y, float log_odds, double p);
+  // Free-space update of the storage runs of one span of a clearing cone
+  void clearRuns(const CellSpan* runs, unsigned int pieces, float weight);
+  void updateCostmap(RangeReading& range_message, bool clear_sensor_cone);
+
+  bool canTransformRange(unsigned int sensor, const ros::Time& stamp);
+  bool transformRange(const RangeReading& range_message, double* ox, double* oy, double* tx, double* ty);
 
-  double gamma(double theta);
+  // Sensor frames are only ever appended, so a published index stays valid for good
+  bool internSensorFrame(const std::string& frame_id, unsigned int* sensor);
+  const std::string& sensorFrame(unsigned int sensor) const { return sensor_frames_[sensor]; }
+
+  double gamma(double theta, double max_angle);
   double delta(double phi);
-  double sensor_model(double r, double phi, double theta);
+  double sensor_model(double r, double phi, double theta, double max_angle);
+  double sensor_model_lookup(double r, double phi, double theta, double max_angle);
+  void buildSensorModelTables();
 
   void get_deltas(double angle, double *dx, double *dy);
-  void update_cell(double ox, double oy, double ot, double r, double nx, double ny, bool clear);
+  double cone_model(double dx, double dy, double ot, double r, double max_angle);
+  double combine_likelihood(double sensor, unsigned int weight);
+  void update_cell(unsigned char& cell, double sensor);
 
   double to_prob(unsigned char c){ return double(c)/costmap_2d::LETHAL_OBSTACLE; }
   unsigned char to_cost(double p){ return (unsigned char)(p*costmap_2d::LETHAL_OBSTACLE); }
 
-  boost::function<void (sensor_msgs::Range& range_message)> processRangeMessageFunc_;
-  boost::mutex range_message_mutex_;
-  std::list<sensor_msgs::Range> range_msgs_buffer_;
+  boost::function<void (RangeReading& range_message)> processRangeMessageFunc_;
+  BoundedQueue<RangeReading> range_queue_;
+  std::vector<RangeReading> cycle_readings_;
+  // Readings whose transform was not available yet, retried on the next cycle
+  std::vector<RangeReading> pending_readings_;
+  double pending_timeout_;
+  unsigned int deferred_readings_, dropped_readings_;
+  unsigned long overflowed_readings_, queue_overflows_seen_;
+
+  // Readings of one sensor within a cycle are integrated once, either keeping only the
+  // latest or fusing those that agree on the range
+  enum CoalescePolicy
+  {
+    COALESCE_NONE,
+    COALESCE_LATEST,
+    COALESCE_COMBINED
+  };
+  CoalescePolicy coalesce_policy_;
+  std::vector<int> coalesce_groups_;
+  unsigned int coalesced_readings_;
+
+  std::vector<std::string> sensor_frames_;
+  boost::atomic<unsigned int> sensor_frame_count_;
+  boost::mutex sensor_frame_mutex_;
+
+  // With static_sensor_transforms_, each sensor's mounting transform (into base_frame_)
+  // is looked up once, and all readings of a cycle share one base_frame_ -> global lookup
+  struct SensorMount
+  {
+    bool cached;
+    tf::Transform mount;
+    double ox, oy, ux, uy;  // sensor origin and x axis in the global frame, this cycle
+  };
+  void updateSensorPose(SensorMount& sensor);
+
+  bool static_sensor_transforms_;
+  std::string base_frame_;
+  std::vector<SensorMount> sensor_mounts_;  // indexed like sensor_frames_
+  tf::StampedTransform base_transform_;
+  bool base_transform_valid_;
+
+  LaserFusion laser_fusion_;
 
-  boost::mutex scan_message_mutex_;
-  sensor_msgs::LaserScan scan_msgs_;
+  // With integrate_scans_, every incoming scan is also queued for integration into the
+  // grid; the fusion history is too short to hold a cycle's worth of scans
+  bool integrate_scans_;
+  BoundedQueue<sensor_msgs::LaserScanConstPtr> scan_queue_;
+  unsigned long scan_overflows_seen_;
+  std::vector<sensor_msgs::LaserScanConstPtr> cycle_scans_, pending_scans_;
+  ScanBeams scan_beams_;
+  std::vector<float> scan_ex_, scan_ey_;
+  double scan_hit_probability_, scan_miss_probability_;
+  unsigned int decimated_beams_;
   double max_angle_, phi_v_;
   std::string global_frame_;
 
   double clear_threshold_, mark_threshold_;
   bool clear_on_max_reading_;
 
+  // Tabulated factors of sensor_model(): delta() sampled over phi, gamma() over
+  // theta / max_angle_, and the radial profile over phi / r
+  bool exact_sensor_model_;
+  std::vector<float> delta_table_, gamma_table_, radial_table_;
+  double delta_table_scale_, radial_table_scale_;
+  double table_phi_v_, table_resolution_;
+
+  // Cones of the current cycle; rasterized while readings are processed and applied to
+  // the grid afterwards, possibly in parallel
+  struct ConeStencil;
+  struct ConeUpdate
+  {
+    double ox, oy, theta, range, half_angle;
+    bool clear;
+    unsigned int weight;
+    int target_x, target_y;  // cell set to 233, or -1 when off the grid
+    unsigned int first_span, last_span;  // [first_span, last_span) in cone_spans_
+    boost::shared_ptr<const ConeStencil> stencil;  // set for cached fixed ranger cones
+    int lod;  // side of the cell blocks the model is sampled on
+  };
+  std::vector<ConeUpdate> cone_updates_;
+  std::vector<CellSpan> cone_spans_;
+  std::vector<unsigned int> cone_span_values_;  // per span, first value in the cone's stencil
+
+  // Cone of a fixed ranger rasterized once, relative to the cell holding the sensor, with
+  // the sensor model evaluated for each cell. It is reused until the heading drifts by
+  // more than stencil_heading_bin_ (0 turns the cache off).
+  struct ConeStencil
+  {
+    double theta, half_angle, range;
+    std::vector<CellSpan> spans;
+    std::vector<unsigned int> offsets;  // per span, index of its first cell below
+    std::vector<float> probs, log_odds;
+  };
+  boost::shared_ptr<const ConeStencil> coneStencil(unsigned int sensor, const ConeUpdate& cone, double radius);
+  void appendStencilSpans(const ConeStencil& stencil, int cx, int cy);
+  void clearStencils();
+
+  double stencil_heading_bin_;
+  std::vector<boost::shared_ptr<const ConeStencil> > stencils_;  // 2 per sensor: marking, clearing
+  WorkerPool integration_pool_;
+
+  // With async_integration_, readings are integrated by integration_thread_ as they
+  // arrive, and updateBounds() only collects the accumulated bounds
+  bool async_integration_;
+  boost::thread* integration_thread_;
+  boost::mutex integration_wake_mutex_;
+  boost::condition_variable integration_wake_;
+  bool integration_wake_pending_, integration_stop_;
+
+  // With toroidal_storage_, costmap_ (and log_odds_) hold map cell (x, y) at
+  // ((x + ring_x_) % size_x_, (y + ring_y_) % size_y_), so moving the origin only moves
+  // the offsets and clears the strips that came into view; otherwise both are zero
+  bool toroidal_storage_;
+  int ring_x_, ring_y_;
+
+  // With sparse_storage_, the byte grid lives in sparse_costs_ and costmap_ is NULL;
+  // only for static maps without log-odds, on layers nothing outside reads or clears
+  bool sparse_storage_;
+  SparseTileGrid sparse_costs_;
+
+  // Optional log-odds storage; costmap_ then only holds the costs derived from it
+  bool use_log_odds_;
+  LogOddsGrid log_odds_;
+  // Per worker scratch of integrateCones()
+  struct ConeScratch
+  {
+    ConeScratch() : cone(NULL), block_row(-1), stamp(0) {}
+
+    std::vector<float> row_log_odds, row_probs;
+    // Model values of the blocks of one block row of one cone; a block holds a value
+    // when its stamp is the current one
+    const ConeUpdate* cone;
+    int block_row;
+    unsigned int stamp;
+    std::vector<float> block_values;
+    std::vector<unsigned int> block_stamps;
+  };
+  std::vector<ConeScratch> cone_scratch_;
+  const float* lodRow(ConeScratch& scratch, const ConeUpdate& cone, const CellSpan& span);
+
+  // Readings farther than this are sampled on 2 x 2 blocks, and on 4 x 4 past twice it
+  double lod_distance_;
+
+  // Tiles holding cells that updateCosts() writes to the master grid
+  ActiveTileMap active_tiles_;
+
   double no_readings_timeout_;
   ros::Time last_reading_time_;
   unsigned int buffered_readings_;
   std::vector<ros::Subscriber> range_subs_;
   double min_x_, min_y_, max_x_, max_y_;
-  bool fusion;
 
   dynamic_reconfigure::Server<range_sensor_layer::RangeSensorLayerConfig> *dsrv_;
 };
@@ -0,0 +1,30 @@
+#ifndef RANGE_SENSOR_LAYER_SCAN_BEAMS_H_
+#define RANGE_SENSOR_LAYER_SCAN_BEAMS_H_
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+// Beam directions of a laser, kept while its scans keep the same geometry, and the beam
+// endpoints of one scan worked out from them in a single trig-free pass over the ranges
+class ScanBeams
+{
+public:
+  ScanBeams();
+
+  // Recomputes the directions only when the geometry differs from the last call
+  void setGeometry(float angle_min, float angle_increment, unsigned int beams);
+
+  // Endpoints of all beams for a laser at (x, y) whose frame has the xy rotation
+  // [r00 r01; r10 r11] in the target frame. Ranges past max_range are cut to it, and
+  // invalid ones give garbage the caller is expected to skip.
+  void endpoints(const std::vector<float>& ranges, float max_range, double x, double y, double r00, double r01,
+                 double r10, double r11, std::vector<float>& ex, std::vector<float>& ey) const;
+
+private:
+  float angle_min_, angle_increment_;
+  std::vector<float> cos_, sin_;
+};
+
+}  // namespace range_sensor_layer
+#endif
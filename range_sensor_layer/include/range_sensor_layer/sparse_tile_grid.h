@@ -0,0 +1,68 @@
+#ifndef RANGE_SENSOR_LAYER_SPARSE_TILE_GRID_H_
+#define RANGE_SENSOR_LAYER_SPARSE_TILE_GRID_H_
+#include <range_sensor_layer/active_tile_map.h>
+#include <boost/thread/mutex.hpp>
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+// Byte grid stored as the tiles of ActiveTileMap, each allocated the first time one of
+// its cells is written; the others read as the fill value. Tiles come from a pool that
+// grows in blocks and gets them back on reset(), so memory follows the observed area.
+class SparseTileGrid
+{
+public:
+  static const unsigned int TILE_SHIFT = ActiveTileMap::TILE_SHIFT;
+  static const unsigned int TILE_SIZE = ActiveTileMap::TILE_SIZE;
+  static const unsigned int TILE_CELLS = TILE_SIZE * TILE_SIZE;
+
+  SparseTileGrid();
+  ~SparseTileGrid();
+
+  void resize(unsigned int size_x, unsigned int size_y, unsigned char fill);
+  // Returns every tile to the pool, so all cells read as the fill value again
+  void reset();
+
+  // Cell (x, y), allocating its tile; the cells after it up to the tile edge follow.
+  // Threads may write different tiles at once.
+  unsigned char* row(unsigned int x, unsigned int y)
+  {
+    unsigned char*& tile = tiles_[(y >> TILE_SHIFT) * tiles_x_ + (x >> TILE_SHIFT)];
+    if (!tile)
+      tile = allocate();
+    return tile + ((y & (TILE_SIZE - 1)) << TILE_SHIFT) + (x & (TILE_SIZE - 1));
+  }
+  // Same as row() for reading; unallocated tiles give a row of the fill value
+  const unsigned char* peek(unsigned int x, unsigned int y) const
+  {
+    const unsigned char* tile = tiles_[(y >> TILE_SHIFT) * tiles_x_ + (x >> TILE_SHIFT)];
+    if (!tile)
+      return &fill_row_[x & (TILE_SIZE - 1)];
+    return tile + ((y & (TILE_SIZE - 1)) << TILE_SHIFT) + (x & (TILE_SIZE - 1));
+  }
+  // Rows of TILE_SIZE cells, or NULL while the tile is unallocated
+  const unsigned char* tile(unsigned int tx, unsigned int ty) const { return tiles_[ty * tiles_x_ + tx]; }
+
+  unsigned char fill() const { return fill_; }
+  unsigned int allocatedTiles() const { return allocated_; }
+
+private:
+  SparseTileGrid(const SparseTileGrid&);
+  SparseTileGrid& operator=(const SparseTileGrid&);
+
+  unsigned char* allocate();
+  void release();
+
+  unsigned int size_x_, size_y_, tiles_x_, tiles_y_;
+  unsigned char fill_;
+  std::vector<unsigned char> fill_row_;
+  std::vector<unsigned char*> tiles_;
+
+  boost::mutex pool_mutex_;
+  std::vector<unsigned char*> blocks_, free_;
+  unsigned int allocated_;
+};
+
+}  // namespace range_sensor_layer
+#endif
@@ -0,0 +1,43 @@
+#ifndef RANGE_SENSOR_LAYER_WORKER_POOL_H_
+#define RANGE_SENSOR_LAYER_WORKER_POOL_H_
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <vector>
+
+namespace range_sensor_layer
+{
+
+// A fixed set of threads that all run the same job and are kept alive between jobs,
+// so handing out work costs a wake-up rather than a thread start.
+class WorkerPool
+{
+public:
+  // job(worker, workers), with worker in [0, workers)
+  typedef boost::function<void (unsigned int, unsigned int)> Job;
+
+  WorkerPool();
+  ~WorkerPool();
+
+  // Starts threads helpers; the calling thread always takes part as worker 0
+  void start(unsigned int threads);
+  void stop();
+  unsigned int size() const { return threads_.size() + 1; }
+
+  // Runs job once per worker and returns when all of them are done
+  void run(const Job& job);
+
+private:
+  // seen: the last job generation this worker must not run
+  void workerLoop(unsigned int worker, unsigned long seen);
+
+  std::vector<boost::thread*> threads_;
+  boost::mutex mutex_;
+  boost::condition_variable work_cv_, done_cv_;
+  Job job_;
+  unsigned long generation_;
+  unsigned int busy_;
+  bool stopping_;
+};
+
+}  // namespace range_sensor_layer
+#endif
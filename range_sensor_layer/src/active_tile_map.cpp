@@ -0,0 +1,158 @@
+#include <range_sensor_layer/active_tile_map.h>
+#include <range_sensor_layer/sparse_tile_grid.h>
+#include <costmap_2d/cost_values.h>
+#include <algorithm>
+
+namespace range_sensor_layer
+{
+
+ActiveTileMap::ActiveTileMap() :
+    size_x_(0), size_y_(0), tiles_x_(0), tiles_y_(0), all_dirty_(true), clear_(-1), mark_(-1)
+{
+}
+
+void ActiveTileMap::resize(unsigned int size_x, unsigned int size_y)
+{
+  size_x_ = size_x;
+  size_y_ = size_y;
+  tiles_x_ = (size_x + TILE_SIZE - 1) >> TILE_SHIFT;
+  tiles_y_ = (size_y + TILE_SIZE - 1) >> TILE_SHIFT;
+  active_.assign(tiles_x_ * tiles_y_, 0);
+  dirty_.assign(tiles_x_ * tiles_y_, 0);
+  dirty_list_.clear();
+  all_dirty_ = true;
+}
+
+void ActiveTileMap::markDirty(int y, int x0, int x1)
+{
+  if (all_dirty_)
+    return;
+
+  unsigned int row = (y >> TILE_SHIFT) * tiles_x_;
+  for (unsigned int tx = x0 >> TILE_SHIFT; tx <= (unsigned int)x1 >> TILE_SHIFT; tx++)
+  {
+    if (!dirty_[row + tx])
+    {
+      dirty_[row + tx] = 1;
+      dirty_list_.push_back(row + tx);
+    }
+  }
+}
+
+void ActiveTileMap::markAllDirty()
+{
+  all_dirty_ = true;
+}
+
+void ActiveTileMap::shift(int cell_ox, int cell_oy)
+{
+  if (all_dirty_ || (cell_ox == 0 && cell_oy == 0))
+    return;
+
+  // A tile can only contribute after the shift if one of its cells came from a tile that
+  // did or was still to be re-evaluated, or was reset; only those get re-evaluated
+  std::vector<unsigned char> pending(active_.size());
+  for (unsigned int tile = 0; tile < active_.size(); tile++)
+    pending[tile] = active_[tile] || dirty_[tile];
+  std::fill(active_.begin(), active_.end(), 0);
+  std::fill(dirty_.begin(), dirty_.end(), 0);
+  dirty_list_.clear();
+
+  int size_x = size_x_, size_y = size_y_;
+  for (unsigned int ty = 0; ty < tiles_y_; ty++)
+  {
+    // Source cells [x0, x1] x [y0, y1] of the tile, before the shift
+    int y0 = (ty << TILE_SHIFT) + cell_oy;
+    int y1 = std::min(size_y, (int)((ty + 1) << TILE_SHIFT)) - 1 + cell_oy;
+    for (unsigned int tx = 0; tx < tiles_x_; tx++)
+    {
+      int x0 = (tx << TILE_SHIFT) + cell_ox;
+      int x1 = std::min(size_x, (int)((tx + 1) << TILE_SHIFT)) - 1 + cell_ox;
+
+      bool touched = x0 < 0 || y0 < 0 || x1 >= size_x || y1 >= size_y;
+      for (int sy = y0 >> TILE_SHIFT; !touched && sy <= y1 >> TILE_SHIFT; sy++)
+        for (int sx = x0 >> TILE_SHIFT; !touched && sx <= x1 >> TILE_SHIFT; sx++)
+          touched = pending[sy * tiles_x_ + sx] != 0;
+
+      if (touched)
+      {
+        dirty_[ty * tiles_x_ + tx] = 1;
+        dirty_list_.push_back(ty * tiles_x_ + tx);
+      }
+    }
+  }
+}
+
+void ActiveTileMap::refresh(const unsigned char* costs, unsigned char clear, unsigned char mark)
+{
+  beginRefresh(clear, mark);
+
+  for (std::vector<unsigned int>::const_iterator tile = dirty_list_.begin(); tile != dirty_list_.end(); ++tile)
+  {
+    unsigned int tx = *tile % tiles_x_, ty = *tile / tiles_x_;
+    unsigned int x0 = tx << TILE_SHIFT, x1 = std::min(size_x_, x0 + TILE_SIZE);
+    unsigned int y0 = ty << TILE_SHIFT, y1 = std::min(size_y_, y0 + TILE_SIZE);
+
+    active_[*tile] = contributes(costs + y0 * size_x_ + x0, size_x_, x1 - x0, y1 - y0);
+    dirty_[*tile] = 0;
+  }
+
+  dirty_list_.clear();
+}
+
+void ActiveTileMap::refresh(const SparseTileGrid& costs, unsigned char clear, unsigned char mark)
+{
+  beginRefresh(clear, mark);
+
+  // An unallocated tile holds nothing but the fill value
+  unsigned char fill = costs.fill();
+  bool fill_contributes = contributes(&fill, 0, 1, 1);
+
+  for (std::vector<unsigned int>::const_iterator tile = dirty_list_.begin(); tile != dirty_list_.end(); ++tile)
+  {
+    unsigned int tx = *tile % tiles_x_, ty = *tile / tiles_x_;
+    unsigned int x0 = tx << TILE_SHIFT, x1 = std::min(size_x_, x0 + TILE_SIZE);
+    unsigned int y0 = ty << TILE_SHIFT, y1 = std::min(size_y_, y0 + TILE_SIZE);
+
+    const unsigned char* cells = costs.tile(tx, ty);
+    active_[*tile] = cells ? contributes(cells, TILE_SIZE, x1 - x0, y1 - y0) : fill_contributes;
+    dirty_[*tile] = 0;
+  }
+
+  dirty_list_.clear();
+}
+
+void ActiveTileMap::beginRefresh(unsigned char clear, unsigned char mark)
+{
+  if (clear != clear_ || mark != mark_)
+  {
+    clear_ = clear;
+    mark_ = mark;
+    all_dirty_ = true;
+  }
+
+  if (all_dirty_)
+  {
+    dirty_list_.clear();
+    for (unsigned int tile = 0; tile < active_.size(); tile++)
+      dirty_list_.push_back(tile);
+  }
+  all_dirty_ = false;
+}
+
+bool ActiveTileMap::contributes(const unsigned char* cells, unsigned int stride, unsigned int width,
+                                unsigned int height) const
+{
+  for (unsigned int y = 0; y < height; y++, cells += stride)
+  {
+    for (unsigned int x = 0; x < width; x++)
+    {
+      unsigned char prob = cells[x];
+      if (prob != costmap_2d::NO_INFORMATION && (prob > mark_ || prob < clear_))
+        return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace range_sensor_layer
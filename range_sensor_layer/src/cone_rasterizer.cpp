@@ -0,0 +1,99 @@
+#include <range_sensor_layer/cone_rasterizer.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace range_sensor_layer
+{
+
+// Restricts [lo, hi] to the points px of the row at height py with n.x * px + n.y * py >= 0
+static void clipHalfPlane(double nx, double ny, double py, double* lo, double* hi)
+{
+  double c = ny * py;
+  if (nx > 0)
+    *lo = std::max(*lo, -c / nx);
+  else if (nx < 0)
+    *hi = std::min(*hi, -c / nx);
+  else if (c < 0)
+    *hi = -std::numeric_limits<double>::infinity();
+}
+
+static void addSpan(int y, double lo, double hi, double cx, unsigned int size_x, std::vector<CellSpan>& spans)
+{
+  // Cell i is inside when its center i + 0.5 lies in [cx + lo, cx + hi]
+  int x0 = std::max(0, (int)ceil(cx + lo - 0.5));
+  int x1 = std::min((int)size_x - 1, (int)floor(cx + hi - 0.5));
+  if (x0 > x1)
+    return;
+  CellSpan span = { y, x0, x1 };
+  spans.push_back(span);
+}
+
+void rasterizeCone(double cx, double cy, double theta, double half_angle, double radius,
+                   unsigned int size_x, unsigned int size_y, std::vector<CellSpan>& spans)
+{
+  if (radius <= 0 || half_angle <= 0 || size_x == 0 || size_y == 0)
+    return;
+
+  // Inward normals of the two bounding rays: the wedge lies to the left of the ray at
+  // theta - half_angle and to the right of the ray at theta + half_angle
+  double n1x = -sin(theta - half_angle), n1y = cos(theta - half_angle);
+  double n2x = sin(theta + half_angle), n2y = -cos(theta + half_angle);
+  bool convex = half_angle < M_PI / 2;
+  bool full_disk = half_angle >= M_PI;
+
+  // Rows whose centers are within radius of the apex
+  int y0 = std::max(0, (int)ceil(cy - radius - 0.5));
+  int y1 = std::min((int)size_y - 1, (int)floor(cy + radius - 0.5));
+  double inf = std::numeric_limits<double>::infinity();
+
+  for (int y = y0; y <= y1; y++)
+  {
+    double py = y + 0.5 - cy;
+    double w2 = radius * radius - py * py;
+    if (w2 < 0)
+      continue;
+    double w = sqrt(w2);
+
+    if (full_disk)
+    {
+      addSpan(y, -w, w, cx, size_x, spans);
+    }
+    else if (convex)
+    {
+      double lo = -w, hi = w;
+      clipHalfPlane(n1x, n1y, py, &lo, &hi);
+      clipHalfPlane(n2x, n2y, py, &lo, &hi);
+      if (lo <= hi)
+        addSpan(y, lo, hi, cx, size_x, spans);
+    }
+    else
+    {
+      // Reflex wedge: the union of the two half-planes, at most two runs per row
+      double lo1 = -inf, hi1 = inf, lo2 = -inf, hi2 = inf;
+      clipHalfPlane(n1x, n1y, py, &lo1, &hi1);
+      clipHalfPlane(n2x, n2y, py, &lo2, &hi2);
+      lo1 = std::max(lo1, -w);
+      hi1 = std::min(hi1, w);
+      lo2 = std::max(lo2, -w);
+      hi2 = std::min(hi2, w);
+      bool has1 = lo1 <= hi1, has2 = lo2 <= hi2;
+      if (has1 && has2 && lo2 <= hi1 && lo1 <= hi2)
+        addSpan(y, std::min(lo1, lo2), std::max(hi1, hi2), cx, size_x, spans);
+      else
+      {
+        if (has1 && has2 && lo2 < lo1)
+        {
+          std::swap(lo1, lo2);
+          std::swap(hi1, hi2);
+        }
+        if (has1)
+          addSpan(y, lo1, hi1, cx, size_x, spans);
+        if (has2)
+          addSpan(y, lo2, hi2, cx, size_x, spans);
+      }
+    }
+  }
+}
+
+}  // namespace range_sensor_layer
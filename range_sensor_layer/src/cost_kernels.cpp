@@ -0,0 +1,129 @@
+#include <range_sensor_layer/cost_kernels.h>
+#include <costmap_2d/cost_values.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RANGE_SENSOR_LAYER_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using costmap_2d::NO_INFORMATION;
+using costmap_2d::LETHAL_OBSTACLE;
+using costmap_2d::FREE_SPACE;
+
+namespace range_sensor_layer
+{
+
+typedef void (*MergeRowFunction)(const unsigned char*, unsigned char*, unsigned int, unsigned char, unsigned char);
+
+static void mergeThresholdedRowScalar(const unsigned char* layer, unsigned char* master, unsigned int n,
+                                      unsigned char clear, unsigned char mark)
+{
+  for (unsigned int i = 0; i < n; i++)
+  {
+    unsigned char prob = layer[i];
+    unsigned char current;
+    if(prob==NO_INFORMATION)
+      continue;
+    else if(prob>mark)
+      current = LETHAL_OBSTACLE;
+    else if(prob<clear)
+      current = FREE_SPACE;
+    else
+      continue;
+
+    unsigned char old_cost = master[i];
+    if (old_cost == NO_INFORMATION || old_cost < current)
+      master[i] = current;
+  }
+}
+
+#ifdef RANGE_SENSOR_LAYER_X86_KERNELS
+// SSE2 and AVX2 only compare signed bytes, so unsigned comparisons flip the sign bit
+// of both operands first
+
+__attribute__((target("sse2")))
+static void mergeThresholdedRowSSE2(const unsigned char* layer, unsigned char* master, unsigned int n,
+                                    unsigned char clear, unsigned char mark)
+{
+  const __m128i sign = _mm_set1_epi8((char)0x80);
+  const __m128i no_information = _mm_set1_epi8((char)NO_INFORMATION);
+  const __m128i lethal = _mm_set1_epi8((char)LETHAL_OBSTACLE);
+  const __m128i mark_s = _mm_set1_epi8((char)(mark ^ 0x80));
+  const __m128i clear_s = _mm_set1_epi8((char)(clear ^ 0x80));
+
+  unsigned int i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m128i prob = _mm_loadu_si128((const __m128i*)(layer + i));
+    __m128i old_cost = _mm_loadu_si128((const __m128i*)(master + i));
+    __m128i prob_s = _mm_xor_si128(prob, sign);
+
+    __m128i unknown = _mm_cmpeq_epi8(prob, no_information);
+    __m128i marked = _mm_andnot_si128(unknown, _mm_cmpgt_epi8(prob_s, mark_s));
+    __m128i cleared = _mm_cmpgt_epi8(clear_s, prob_s);
+    __m128i current = _mm_and_si128(marked, lethal);
+
+    __m128i raises = _mm_or_si128(_mm_cmpeq_epi8(old_cost, no_information),
+                                  _mm_cmpgt_epi8(_mm_xor_si128(current, sign), _mm_xor_si128(old_cost, sign)));
+    __m128i write = _mm_and_si128(_mm_or_si128(marked, cleared), raises);
+
+    __m128i result = _mm_or_si128(_mm_and_si128(write, current), _mm_andnot_si128(write, old_cost));
+    _mm_storeu_si128((__m128i*)(master + i), result);
+  }
+  mergeThresholdedRowScalar(layer + i, master + i, n - i, clear, mark);
+}
+
+__attribute__((target("avx2")))
+static void mergeThresholdedRowAVX2(const unsigned char* layer, unsigned char* master, unsigned int n,
+                                    unsigned char clear, unsigned char mark)
+{
+  const __m256i sign = _mm256_set1_epi8((char)0x80);
+  const __m256i no_information = _mm256_set1_epi8((char)NO_INFORMATION);
+  const __m256i lethal = _mm256_set1_epi8((char)LETHAL_OBSTACLE);
+  const __m256i mark_s = _mm256_set1_epi8((char)(mark ^ 0x80));
+  const __m256i clear_s = _mm256_set1_epi8((char)(clear ^ 0x80));
+
+  unsigned int i = 0;
+  for (; i + 32 <= n; i += 32)
+  {
+    __m256i prob = _mm256_loadu_si256((const __m256i*)(layer + i));
+    __m256i old_cost = _mm256_loadu_si256((const __m256i*)(master + i));
+    __m256i prob_s = _mm256_xor_si256(prob, sign);
+
+    __m256i unknown = _mm256_cmpeq_epi8(prob, no_information);
+    __m256i marked = _mm256_andnot_si256(unknown, _mm256_cmpgt_epi8(prob_s, mark_s));
+    __m256i cleared = _mm256_cmpgt_epi8(clear_s, prob_s);
+    __m256i current = _mm256_and_si256(marked, lethal);
+
+    __m256i raises = _mm256_or_si256(_mm256_cmpeq_epi8(old_cost, no_information),
+                                     _mm256_cmpgt_epi8(_mm256_xor_si256(current, sign),
+                                                       _mm256_xor_si256(old_cost, sign)));
+    __m256i write = _mm256_and_si256(_mm256_or_si256(marked, cleared), raises);
+
+    __m256i result = _mm256_or_si256(_mm256_and_si256(write, current), _mm256_andnot_si256(write, old_cost));
+    _mm256_storeu_si256((__m256i*)(master + i), result);
+  }
+  mergeThresholdedRowSSE2(layer + i, master + i, n - i, clear, mark);
+}
+#endif
+
+static MergeRowFunction selectMergeRow()
+{
+#ifdef RANGE_SENSOR_LAYER_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return mergeThresholdedRowAVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return mergeThresholdedRowSSE2;
+#endif
+  return mergeThresholdedRowScalar;
+}
+
+void mergeThresholdedRow(const unsigned char* layer, unsigned char* master, unsigned int n,
+                         unsigned char clear, unsigned char mark)
+{
+  static const MergeRowFunction merge_row = selectMergeRow();
+  merge_row(layer, master, n, clear, mark);
+}
+
+}  // namespace range_sensor_layer
@@ -0,0 +1,154 @@
+#include <range_sensor_layer/laser_fusion.h>
+#include <cmath>
+
+namespace range_sensor_layer
+{
+
+// Samples along each beam when testing whether it crosses a sensor's cone
+const int WINDOW_SAMPLES = 200;
+
+LaserFusion::LaserFusion() : tf_(NULL), scan_count_(0), tolerance_(0.2), ratio_(0.75), max_dt_(0.1) {}
+
+void LaserFusion::init(tf::TransformListener* tf, unsigned int history_size, unsigned int max_sensors)
+{
+  tf_ = tf;
+  history_.assign(std::max(history_size, 1u), sensor_msgs::LaserScanConstPtr());
+  scan_count_.store(0);
+  windows_.resize(max_sensors);
+  for (unsigned int i = 0; i < max_sensors; i++)
+    windows_[i].valid = false;
+}
+
+void LaserFusion::setParameters(double tolerance, double ratio, double max_dt)
+{
+  tolerance_ = tolerance;
+  ratio_ = ratio;
+  max_dt_ = max_dt;
+}
+
+void LaserFusion::addScan(const sensor_msgs::LaserScanConstPtr& scan)
+{
+  unsigned long n = scan_count_.load(boost::memory_order_relaxed);
+  boost::atomic_store(&history_[n % history_.size()], scan);
+  scan_count_.store(n + 1, boost::memory_order_release);
+}
+
+sensor_msgs::LaserScanConstPtr LaserFusion::latestScan() const
+{
+  unsigned long n = scan_count_.load(boost::memory_order_acquire);
+  if (n == 0)
+    return sensor_msgs::LaserScanConstPtr();
+  return boost::atomic_load(&history_[(n - 1) % history_.size()]);
+}
+
+sensor_msgs::LaserScanConstPtr LaserFusion::closestScan(const ros::Time& stamp) const
+{
+  sensor_msgs::LaserScanConstPtr best;
+  double best_dt = 0.0;
+  for (size_t i = 0; i < history_.size(); i++)
+  {
+    sensor_msgs::LaserScanConstPtr scan = boost::atomic_load(&history_[i]);
+    if (!scan)
+      continue;
+    double dt = fabs((scan->header.stamp - stamp).toSec());
+    if (!best || dt < best_dt)
+    {
+      best = scan;
+      best_dt = dt;
+    }
+  }
+  return best;
+}
+
+bool LaserFusion::updateWindow(BeamWindow& window, const std::string& sensor_frame,
+                               const sensor_msgs::LaserScan& scan, float field_of_view, float max_range)
+{
+  if (window.valid && window.laser_frame == scan.header.frame_id && window.scan_size == scan.ranges.size() &&
+      window.angle_min == scan.angle_min && window.angle_increment == scan.angle_increment &&
+      window.field_of_view == field_of_view && window.max_range == max_range)
+    return true;
+
+  tf::StampedTransform laser_to_sensor;
+  try
+  {
+    tf_->lookupTransform(sensor_frame, scan.header.frame_id, ros::Time(0), laser_to_sensor);
+  }
+  catch (tf::TransformException& ex)
+  {
+    ROS_WARN_THROTTLE(1.0, "Range sensor layer can't transform from %s to %s: %s", sensor_frame.c_str(),
+                      scan.header.frame_id.c_str(), ex.what());
+    window.valid = false;
+    return false;
+  }
+
+  window.laser_frame = scan.header.frame_id;
+  window.scan_size = scan.ranges.size();
+  window.angle_min = scan.angle_min;
+  window.angle_increment = scan.angle_increment;
+  window.field_of_view = field_of_view;
+  window.max_range = max_range;
+  window.lx = laser_to_sensor.getOrigin().x();
+  window.ly = laser_to_sensor.getOrigin().y();
+  window.cos_half_fov = cos(field_of_view / 2);
+  window.beams.clear();
+  window.dx.clear();
+  window.dy.clear();
+
+  // A beam belongs to the window if some point along it, up to the far edge of the
+  // cone, falls inside the cone
+  double reach = max_range + sqrt(window.lx * window.lx + window.ly * window.ly);
+  double step = reach / WINDOW_SAMPLES;
+  double limit = max_range * max_range;
+  for (size_t i = 0; i < scan.ranges.size(); i++)
+  {
+    double angle = scan.angle_min + i * scan.angle_increment;
+    tf::Vector3 dir = laser_to_sensor.getBasis() * tf::Vector3(cos(angle), sin(angle), 0);
+    for (int k = 1; k <= WINDOW_SAMPLES; k++)
+    {
+      double px = window.lx + k * step * dir.x(), py = window.ly + k * step * dir.y();
+      double d2 = px * px + py * py;
+      if (d2 <= limit && px >= sqrt(d2) * window.cos_half_fov)
+      {
+        window.beams.push_back(i);
+        window.dx.push_back(dir.x());
+        window.dy.push_back(dir.y());
+        break;
+      }
+    }
+  }
+
+  window.valid = true;
+  ROS_DEBUG("Range sensor layer: %lu laser beams cross the cone of %s", (unsigned long)window.beams.size(),
+            sensor_frame.c_str());
+  return true;
+}
+
+bool LaserFusion::confirms(unsigned int sensor, const std::string& sensor_frame, const ros::Time& stamp,
+                           float field_of_view, float max_range, float range)
+{
+  sensor_msgs::LaserScanConstPtr scan = closestScan(stamp);
+  if (!scan || fabs((scan->header.stamp - stamp).toSec()) > max_dt_)
+    return false;
+
+  BeamWindow& window = windows_[sensor];
+  if (!updateWindow(window, sensor_frame, *scan, field_of_view, max_range) || window.beams.empty())
+    return false;
+
+  // Count the beams whose return lies inside the cone, no farther than the reading
+  double limit = (range + tolerance_) * (range + tolerance_);
+  unsigned int count = 0;
+  for (size_t k = 0; k < window.beams.size(); k++)
+  {
+    float rho = scan->ranges[window.beams[k]];
+    if (!(rho >= scan->range_min && rho <= scan->range_max))
+      continue;
+    double px = window.lx + rho * window.dx[k], py = window.ly + rho * window.dy[k];
+    double d2 = px * px + py * py;
+    if (d2 <= limit && px >= sqrt(d2) * window.cos_half_fov)
+      count++;
+  }
+
+  return count > ratio_ * window.beams.size();
+}
+
+}  // namespace range_sensor_layer
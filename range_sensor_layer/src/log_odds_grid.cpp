@@ -0,0 +1,127 @@
+#include <range_sensor_layer/log_odds_grid.h>
+#include <costmap_2d/cost_values.h>
+#include <algorithm>
+#include <cmath>
+
+namespace range_sensor_layer
+{
+
+// Cells saturate at p ~ 0.0067 / 0.9933, which keeps them able to change their mind
+const float LOG_ODDS_LIMIT = 5.0;
+// A single reading may move a cell across the whole range, so a certain clear empties it
+const float READING_LOG_ODDS_LIMIT = 2 * LOG_ODDS_LIMIT;
+const int LOGIT_TABLE_SIZE = 4096;
+const int COST_TABLE_SIZE = 4096;
+
+LogOddsGrid::LogOddsGrid() : size_x_(0), size_y_(0)
+{
+  logit_table_.resize(LOGIT_TABLE_SIZE + 1);
+  for (int i = 0; i <= LOGIT_TABLE_SIZE; i++)
+  {
+    double p = double(i) / LOGIT_TABLE_SIZE;
+    double l = (p <= 0.0) ? -READING_LOG_ODDS_LIMIT : (p >= 1.0) ? READING_LOG_ODDS_LIMIT : log(p / (1 - p));
+    logit_table_[i] = std::min(std::max(l, (double)-READING_LOG_ODDS_LIMIT), (double)READING_LOG_ODDS_LIMIT);
+  }
+
+  cost_table_.resize(COST_TABLE_SIZE + 1);
+  for (int i = 0; i <= COST_TABLE_SIZE; i++)
+  {
+    double l = -LOG_ODDS_LIMIT + 2 * LOG_ODDS_LIMIT * i / COST_TABLE_SIZE;
+    double p = 1 / (1 + exp(-l));
+    cost_table_[i] = (unsigned char)(p * costmap_2d::LETHAL_OBSTACLE);
+  }
+}
+
+void LogOddsGrid::resize(unsigned int size_x, unsigned int size_y)
+{
+  size_x_ = size_x;
+  size_y_ = size_y;
+  cells_.assign(size_x * size_y, 0.0f);
+  dirty_.clear();
+}
+
+void LogOddsGrid::reset()
+{
+  std::fill(cells_.begin(), cells_.end(), 0.0f);
+  dirty_.clear();
+}
+
+void LogOddsGrid::addRow(unsigned int x, unsigned int y, const float* log_odds, unsigned int n)
+{
+  float* cell = &cells_[y * size_x_ + x];
+  for (unsigned int i = 0; i < n; i++)
+    cell[i] = std::min(std::max(cell[i] + log_odds[i], -LOG_ODDS_LIMIT), LOG_ODDS_LIMIT);
+}
+
+void LogOddsGrid::addConstant(unsigned int x, unsigned int y, float log_odds, unsigned int n)
+{
+  float* cell = &cells_[y * size_x_ + x];
+  for (unsigned int i = 0; i < n; i++)
+    cell[i] = std::min(std::max(cell[i] + log_odds, -LOG_ODDS_LIMIT), LOG_ODDS_LIMIT);
+}
+
+void LogOddsGrid::set(unsigned int x, unsigned int y, double p)
+{
+  cells_[y * size_x_ + x] = std::min(std::max(logOdds(p), -LOG_ODDS_LIMIT), LOG_ODDS_LIMIT);
+}
+
+void LogOddsGrid::markDirty(int y, int x0, int x1)
+{
+  CellSpan span = { y, x0, x1 };
+  dirty_.push_back(span);
+}
+
+void LogOddsGrid::clearRow(unsigned int x, unsigned int y, unsigned int n)
+{
+  std::fill(&cells_[y * size_x_ + x], &cells_[y * size_x_ + x] + n, 0.0f);
+}
+
+void LogOddsGrid::shift(int dx, int dy)
+{
+  if (dx == 0 && dy == 0)
+    return;
+
+  // Cells that stay on the grid, in destination coordinates
+  int x0 = std::max(0, -dx), x1 = std::min((int)size_x_, (int)size_x_ - dx);
+  int y0 = std::max(0, -dy), y1 = std::min((int)size_y_, (int)size_y_ - dy);
+
+  std::vector<float> shifted(cells_.size(), 0.0f);
+  for (int y = y0; y < y1; y++)
+    if (x0 < x1)
+      std::copy(&cells_[(y + dy) * size_x_ + x0 + dx], &cells_[(y + dy) * size_x_ + x1 + dx],
+                &shifted[y * size_x_ + x0]);
+  cells_.swap(shifted);
+
+  // Pending runs refer to the old placement, so callers flush() before shifting
+  dirty_.clear();
+}
+
+void LogOddsGrid::flush(unsigned char* costs)
+{
+  for (std::vector<CellSpan>::const_iterator span = dirty_.begin(); span != dirty_.end(); ++span)
+  {
+    unsigned int index = span->y * size_x_ + span->x0;
+    for (int x = span->x0; x <= span->x1; x++, index++)
+      costs[index] = cost(cells_[index]);
+  }
+  dirty_.clear();
+}
+
+float LogOddsGrid::logOdds(double p) const
+{
+  double x = p * LOGIT_TABLE_SIZE;
+  if (!(x > 0.0))
+    return logit_table_.front();
+  if (!(x < LOGIT_TABLE_SIZE))
+    return logit_table_.back();
+  unsigned int i = (unsigned int)x;
+  return logit_table_[i] + (x - i) * (logit_table_[i + 1] - logit_table_[i]);
+}
+
+unsigned char LogOddsGrid::cost(float log_odds) const
+{
+  int i = (int)((log_odds + LOG_ODDS_LIMIT) * (COST_TABLE_SIZE / (2 * LOG_ODDS_LIMIT)) + 0.5f);
+  return cost_table_[std::min(std::max(i, 0), COST_TABLE_SIZE)];
+}
+
+}  // namespace range_sensor_layer
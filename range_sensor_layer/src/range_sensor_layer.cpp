@@ -2,29 +2,139 @@
 #include <boost/algorithm/string.hpp>
 #include <pluginlib/class_list_macros.h>
 #include <angles/angles.h>
-#include <message_filters/subscriber.h>
-#include <message_filters/time_synchronizer.h>
+#include <cstring>
 
 PLUGINLIB_EXPORT_CLASS(range_sensor_layer::RangeSensorLayer, costmap_2d::Layer)
 
 using costmap_2d::NO_INFORMATION;
 
-const int THRESHOLD = 60;
+// Distinct range sensor frames the layer can tell apart
+const unsigned int MAX_SENSOR_FRAMES = 256;
+
+// Samples per costmap cell (delta table) or per resolution_-wide band of phi / r
+// (radial table) in the tabulated sensor model
+const int TABLE_SUBDIVISIONS = 16;
+// Samples of gamma() over theta / max_angle in [0, 1]
+const int GAMMA_TABLE_SIZE = 256;
+// Distance past phi_v_ beyond which delta() is zero to float precision
+const double DELTA_TABLE_MARGIN = 5.0;
+// Longest delta table; past it lookup() saturates at the last entry
+const unsigned int MAX_DELTA_TABLE_SIZE = 1 << 20;
+
+// Longest the integration thread sleeps without new readings, so deferred ones are retried
+const int INTEGRATION_IDLE_MS = 50;
+
+// Linear interpolation in a table; x is in table index units and saturates at the last entry
+static inline double lookup(const std::vector<float>& table, double x)
+{
+  if (!(x < table.size() - 1))
+    return table.back();
+  unsigned int i = (unsigned int)x;
+  return table[i] + (x - i) * (table[i + 1] - table[i]);
+}
 
 namespace range_sensor_layer
 {
 
-RangeSensorLayer::RangeSensorLayer() {}
+RangeSensorLayer::RangeSensorLayer() :
+    async_integration_(false), integration_thread_(NULL), integration_wake_pending_(false), integration_stop_(false),
+    sparse_storage_(false), dsrv_(NULL)
+{
+}
+
+RangeSensorLayer::~RangeSensorLayer()
+{
+  if (integration_thread_)
+  {
+    {
+      boost::mutex::scoped_lock lock(integration_wake_mutex_);
+      integration_stop_ = true;
+    }
+    integration_wake_.notify_one();
+    integration_thread_->join();
+    delete integration_thread_;
+  }
+}
 
 void RangeSensorLayer::onInitialize()
 {
   ros::NodeHandle nh("~/" + name_);
   current_ = true;
-  fusion = false;
+  exact_sensor_model_ = false;
+  table_phi_v_ = table_resolution_ = -1.0;
+  stencil_heading_bin_ = 0.0;
+  lod_distance_ = 0.0;
   buffered_readings_ = 0;
+  deferred_readings_ = dropped_readings_ = 0;
   last_reading_time_ = ros::Time::now();
   default_value_ = to_cost(0.5);
 
+  nh.param("use_log_odds", use_log_odds_, false);
+  nh.param("static_sensor_transforms", static_sensor_transforms_, false);
+  nh.param("base_frame", base_frame_, std::string("base_link"));
+  nh.param("async_integration", async_integration_, false);
+  nh.param("toroidal_storage", toroidal_storage_, false);
+  ring_x_ = ring_y_ = 0;
+
+  nh.param("sparse_storage", sparse_storage_, false);
+  if (sparse_storage_ && (use_log_odds_ || layered_costmap_->isRolling()))
+  {
+    ROS_WARN("%s: sparse_storage needs a static map and use_log_odds off, using dense storage", name_.c_str());
+    sparse_storage_ = false;
+  }
+  // getCharMap(), getCost(), setCost() and resetMap() are not virtual, so callers that
+  // reach the layer as a Costmap2D, like the clear costmap recoveries, would read
+  // through a NULL dense map. The user has to state that none does.
+  bool external_access;
+  nh.param("external_access", external_access, true);
+  if (sparse_storage_ && external_access)
+  {
+    ROS_ERROR("%s: sparse_storage has no dense map for code that accesses the layer's costmap directly, "
+              "such as clear costmap recoveries; set external_access to false if none does. Using dense storage",
+              name_.c_str());
+    sparse_storage_ = false;
+  }
+  base_transform_valid_ = false;
+
+  int range_buffer_size;
+  std::string overflow_policy;
+  nh.param("range_buffer_size", range_buffer_size, 256);
+  nh.param("range_overflow_policy", overflow_policy, std::string("drop_oldest"));
+  boost::to_lower(overflow_policy);
+  if (overflow_policy != "drop_oldest" && overflow_policy != "drop_newest")
+    ROS_ERROR("%s: Invalid range_overflow_policy: %s, using drop_oldest", name_.c_str(), overflow_policy.c_str());
+  range_queue_.init(std::max(range_buffer_size, 1), overflow_policy == "drop_newest" ?
+                    BoundedQueue<RangeReading>::DROP_NEWEST : BoundedQueue<RangeReading>::DROP_OLDEST);
+  cycle_readings_.reserve(range_queue_.capacity());
+  pending_readings_.reserve(range_queue_.capacity());
+  overflowed_readings_ = queue_overflows_seen_ = 0;
+
+  std::string coalescing;
+  nh.param("range_coalescing", coalescing, std::string("none"));
+  boost::to_lower(coalescing);
+  if (coalescing == "latest")
+    coalesce_policy_ = COALESCE_LATEST;
+  else if (coalescing == "combined")
+    coalesce_policy_ = COALESCE_COMBINED;
+  else
+  {
+    if (coalescing != "none")
+      ROS_ERROR("%s: Invalid range_coalescing: %s, using none", name_.c_str(), coalescing.c_str());
+    coalesce_policy_ = COALESCE_NONE;
+  }
+  coalesced_readings_ = 0;
+
+  int integration_threads;
+  nh.param("integration_threads", integration_threads, 0);
+  integration_pool_.start(std::max(integration_threads, 0));
+  cone_scratch_.resize(integration_pool_.size());
+
+  sensor_frames_.resize(MAX_SENSOR_FRAMES);
+  sensor_mounts_.resize(MAX_SENSOR_FRAMES);
+  for (unsigned int i = 0; i < MAX_SENSOR_FRAMES; i++)
+    sensor_mounts_[i].cached = false;
+  sensor_frame_count_.store(0);
+
   matchSize();
   min_x_ = min_y_ = -std::numeric_limits<double>::max();
   max_x_ = max_y_ = std::numeric_limits<double>::max();
@@ -103,6 +213,14 @@ void RangeSensorLayer::onInitialize()
     }
   }
 
+  int scan_history;
+  nh.param("scan_history", scan_history, 5);
+  laser_fusion_.init(tf_, std::max(scan_history, 1), MAX_SENSOR_FRAMES);
+  nh.param("integrate_scans", integrate_scans_, false);
+  int scan_buffer_size;
+  nh.param("scan_buffer_size", scan_buffer_size, 32);
+  scan_queue_.init(std::max(scan_buffer_size, 1), BoundedQueue<sensor_msgs::LaserScanConstPtr>::DROP_OLDEST);
+  scan_overflows_seen_ = 0;
   range_subs_.push_back(nh.subscribe("/scan", 100, &RangeSensorLayer::bufferIncomingScanMsg, this));
 
   dsrv_ = new dynamic_reconfigure::Server<range_sensor_layer::RangeSensorLayerConfig>(nh);
@@ -111,22 +229,39 @@ void RangeSensorLayer::onInitialize()
   dsrv_->setCallback(cb);
   global_frame_ = layered_costmap_->getGlobalFrameID();
 
- /* 
-  message_filters::Subscriber<sensor_msgs::LaserScan> scan_sub(nh, "/scan", 10);
-  message_filters::Subscriber<sensor_msgs::Range> sonar_sub(nh, range_subs_.back().getTopic().c_str(), 10);  
+  if (async_integration_)
+  {
+    integration_thread_ = new boost::thread(boost::bind(&RangeSensorLayer::integrationLoop, this));
+  }
+}
+
+void RangeSensorLayer::integrationLoop()
+{
+  for (;;)
+  {
+    {
+      boost::mutex::scoped_lock lock(integration_wake_mutex_);
+      if (!integration_wake_pending_ && !integration_stop_)
+        integration_wake_.timed_wait(lock, boost::posix_time::milliseconds(INTEGRATION_IDLE_MS));
+      if (integration_stop_)
+        return;
+      integration_wake_pending_ = false;
+    }
 
-  message_filters::TimeSynchronizer<sensor_msgs::LaserScan, sensor_msgs::Range> sync(scan_sub, sonar_sub, 60);
-  sync.registerCallback(boost::bind(&RangeSensorLayer::syncCB, this, _1, _2));
-*/
+    // updateOrigin(), reset() and updateCosts() take the same lock, so each batch lands
+    // on a grid that does not move underneath it
+    boost::unique_lock<mutex_t> lock(*getMutex());
+    updateCostmap();
+  }
 }
 
 
-double RangeSensorLayer::gamma(double theta)
+double RangeSensorLayer::gamma(double theta, double max_angle)
 {
-    if(fabs(theta)>max_angle_)
+    if(fabs(theta)>max_angle)
         return 0.0;
     else
-        return 1 - pow(theta/max_angle_, 2);
+        return 1 - pow(theta/max_angle, 2);
 }
 
 double RangeSensorLayer::delta(double phi)
@@ -146,9 +281,9 @@ void RangeSensorLayer::get_deltas(double angle, double *dx, double *dy)
     *dy = copysign(resolution_, sin(angle));
 }
 
-double RangeSensorLayer::sensor_model(double r, double phi, double theta)
+double RangeSensorLayer::sensor_model(double r, double phi, double theta, double max_angle)
 {
-    double lbda = delta(phi)*gamma(theta);
+    double lbda = delta(phi)*gamma(theta, max_angle);
 
     double delta = resolution_;
 
@@ -164,51 +299,91 @@ double RangeSensorLayer::sensor_model(double r, double phi, double theta)
         return 0.5;
 }
 
+double RangeSensorLayer::sensor_model_lookup(double r, double phi, double theta, double max_angle)
+{
+    if(r <= 0.0)
+        return 0.5;
+
+    double lbda = lookup(delta_table_, phi * delta_table_scale_) *
+                  lookup(gamma_table_, fabs(theta) / max_angle * GAMMA_TABLE_SIZE);
 
+    return 0.5 + lbda * lookup(radial_table_, phi / r * radial_table_scale_);
+}
 
-void RangeSensorLayer::syncCB(const sensor_msgs::Range& range_message)
+void RangeSensorLayer::buildSensorModelTables()
 {
-  
-   scan_message_mutex_.lock();
-   sensor_msgs::LaserScan scan_message = scan_msgs_;
-   scan_message_mutex_.unlock();
+  if (phi_v_ == table_phi_v_ && resolution_ == table_resolution_)
+    return;
 
-   size_t raduis_center = scan_message.ranges.size()/2;
-   if (scan_message.ranges[raduis_center] > range_message.range + 0.2) {
-      fusion = false;
-      return;
-   }
+  // sensor_model() == 0.5 + delta(phi) * gamma(theta) * radial(phi / r), where the
+  // radial profile has its transitions at multiples of resolution_ (in units of r)
+  double step = resolution_ / TABLE_SUBDIVISIONS;
+  // Argument order keeps a NaN phi_v_ from reaching the cast
+  double span = std::max(0.0, phi_v_ + DELTA_TABLE_MARGIN);
+  unsigned int n = (unsigned int)std::min((double)MAX_DELTA_TABLE_SIZE, ceil(span / step) + 1);
+  delta_table_.resize(n);
+  for (unsigned int i = 0; i < n; i++)
+    delta_table_[i] = delta(i * step);
+  delta_table_scale_ = 1.0 / step;
+
+  gamma_table_.resize(GAMMA_TABLE_SIZE + 1);
+  for (int i = 0; i <= GAMMA_TABLE_SIZE; i++)
+  {
+    double t = double(i) / GAMMA_TABLE_SIZE;
+    gamma_table_[i] = 1 - t * t;
+  }
 
-   size_t raduis_start = scan_message.ranges.size()/2 - 40;
-   size_t raduis_stop = scan_message.ranges.size()/2 + 40;
-   unsigned int count = 0;
+  double d = resolution_;
+  n = (unsigned int)ceil((1 + d) / step) + 1;
+  radial_table_.resize(n);
+  for (unsigned int i = 0; i < n; i++)
+  {
+    double u = i * step;
+    if (u < 1 - 2 * d)
+      radial_table_[i] = -0.5;
+    else if (u < 1 - d)
+    {
+      double s = (u - (1 - 2 * d)) / d;
+      radial_table_[i] = 0.5 * s * s - 0.5;
+    }
+    else if (u < 1 + d)
+    {
+      double J = (1 - u) / d;
+      radial_table_[i] = 0.5 - 0.5 * J * J;
+    }
+    else
+      radial_table_[i] = 0.0;
+  }
+  radial_table_scale_ = 1.0 / step;
 
-   for (size_t i = raduis_start; i < raduis_stop; i++)
-   {
-      float scan_data = scan_message.ranges[i];
-   //   ROS_INFO("scan_data: %f, index %d", scan_data, i);
-      if (!std::isfinite(scan_data)) 
-          continue;
+  table_phi_v_ = phi_v_;
+  table_resolution_ = resolution_;
+  ROS_DEBUG("%s: rebuilt sensor model tables (%u radial, %lu delta samples)", name_.c_str(), n,
+            (unsigned long)delta_table_.size());
+}
 
-      if (scan_data < range_message.range + 0.2)
-          count++; 
-   }
-   ROS_INFO("count %d", count);
-   if (count > THRESHOLD)
-       fusion = true;
-   else
-       fusion = false;
 
-}
 
 void RangeSensorLayer::reconfigureCB(range_sensor_layer::RangeSensorLayerConfig &config, uint32_t level)
 {
+  // The integration thread reads all of these while it runs
+  boost::unique_lock<mutex_t> lock(*getMutex());
   phi_v_ = config.phi;
   max_angle_ = config.max_angle;
   no_readings_timeout_ = config.no_readings_timeout;
+  pending_timeout_ = config.pending_timeout;
+  laser_fusion_.setParameters(config.fusion_tolerance, config.fusion_ratio, config.fusion_max_dt);
+  clear_threshold_ = config.clear_threshold;
   mark_threshold_ = config.mark_threshold;
   clear_on_max_reading_ = config.clear_on_max_reading;
-    
+  exact_sensor_model_ = config.exact_sensor_model;
+  stencil_heading_bin_ = config.stencil_heading_bin;
+  lod_distance_ = config.lod_distance;
+  scan_hit_probability_ = config.scan_hit_probability;
+  scan_miss_probability_ = config.scan_miss_probability;
+  buildSensorModelTables();
+  clearStencils();
+
   if(enabled_ != config.enabled)
   {
     enabled_ = config.enabled;
@@ -218,34 +393,209 @@ void RangeSensorLayer::reconfigureCB(range_sensor_layer::RangeSensorLayerConfig
 
 void RangeSensorLayer::bufferIncomingScanMsg(const sensor_msgs::LaserScanConstPtr& scan_message)
 {
-    boost::mutex::scoped_lock lock(scan_message_mutex_);
-    scan_msgs_ = *scan_message;
+    laser_fusion_.addScan(scan_message);
+    if (!integrate_scans_)
+      return;
+
+    scan_queue_.push(scan_message);
+    if (async_integration_)
+    {
+      {
+        boost::mutex::scoped_lock lock(integration_wake_mutex_);
+        integration_wake_pending_ = true;
+      }
+      integration_wake_.notify_one();
+    }
 }
 
 void RangeSensorLayer::bufferIncomingRangeMsg(const sensor_msgs::RangeConstPtr& range_message)
 {
-  ROS_INFO("range coming");
-  boost::mutex::scoped_lock lock(range_message_mutex_);
-  range_msgs_buffer_.push_back(*range_message);
+  RangeReading reading;
+  if (!internSensorFrame(range_message->header.frame_id, &reading.sensor))
+  {
+    ROS_ERROR_THROTTLE(1.0, "%s: more than %u range sensor frames, ignoring %s", name_.c_str(), MAX_SENSOR_FRAMES,
+                       range_message->header.frame_id.c_str());
+    return;
+  }
+  reading.stamp = range_message->header.stamp;
+  reading.field_of_view = range_message->field_of_view;
+  reading.min_range = range_message->min_range;
+  reading.max_range = range_message->max_range;
+  reading.range = range_message->range;
+  reading.weight = 1;
+  range_queue_.push(reading);
+
+  if (async_integration_)
+  {
+    {
+      boost::mutex::scoped_lock lock(integration_wake_mutex_);
+      integration_wake_pending_ = true;
+    }
+    integration_wake_.notify_one();
+  }
+}
+
+bool RangeSensorLayer::internSensorFrame(const std::string& frame_id, unsigned int* sensor)
+{
+  unsigned int count = sensor_frame_count_.load(boost::memory_order_acquire);
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (sensor_frames_[i] == frame_id)
+    {
+      *sensor = i;
+      return true;
+    }
+  }
+
+  // New frame: append it under the lock, then publish the entry by bumping the count
+  boost::mutex::scoped_lock lock(sensor_frame_mutex_);
+  count = sensor_frame_count_.load(boost::memory_order_relaxed);
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (sensor_frames_[i] == frame_id)
+    {
+      *sensor = i;
+      return true;
+    }
+  }
+  if (count == MAX_SENSOR_FRAMES)
+    return false;
+
+  sensor_frames_[count] = frame_id;
+  sensor_frame_count_.store(count + 1, boost::memory_order_release);
+  *sensor = count;
+  return true;
 }
 
 void RangeSensorLayer::updateCostmap()
 {
-  std::list<sensor_msgs::Range> range_msgs_buffer_copy;
+  // Readings still waiting for their transform go first, to keep arrival order
+  cycle_readings_.swap(pending_readings_);
+  pending_readings_.clear();
+  range_queue_.drain(cycle_readings_);
+
+  unsigned long queue_overflows = range_queue_.overflows();
+  overflowed_readings_ = queue_overflows - queue_overflows_seen_;
+  queue_overflows_seen_ = queue_overflows;
 
-  range_message_mutex_.lock();
-  range_msgs_buffer_copy = std::list<sensor_msgs::Range>(range_msgs_buffer_);
-  range_msgs_buffer_.clear();
-  range_message_mutex_.unlock();
+  deferred_readings_ = dropped_readings_ = 0;
+  ros::Time now = ros::Time::now();
+
+  if (static_sensor_transforms_)
+  {
+    try
+    {
+      tf_->lookupTransform(global_frame_, base_frame_, ros::Time(0), base_transform_);
+      base_transform_valid_ = true;
+      unsigned int count = sensor_frame_count_.load(boost::memory_order_acquire);
+      for (unsigned int i = 0; i < count; i++)
+        if (sensor_mounts_[i].cached)
+          updateSensorPose(sensor_mounts_[i]);
+    }
+    catch (tf::TransformException& ex)
+    {
+      base_transform_valid_ = false;
+      ROS_ERROR_THROTTLE(1.0, "Range sensor layer can't transform from %s to %s: %s",
+                         global_frame_.c_str(), base_frame_.c_str(), ex.what());
+    }
+  }
 
-  for (std::list<sensor_msgs::Range>::iterator range_msgs_it = range_msgs_buffer_copy.begin();
-      range_msgs_it != range_msgs_buffer_copy.end(); range_msgs_it++)
+  // Keep the readings that can be transformed now, in order
+  std::vector<RangeReading>::iterator ready = cycle_readings_.begin();
+  for (std::vector<RangeReading>::iterator range_msgs_it = cycle_readings_.begin();
+      range_msgs_it != cycle_readings_.end(); range_msgs_it++)
   {
+    // Never block the update thread on tf; retry on a later cycle instead
+    if (!canTransformRange(range_msgs_it->sensor, range_msgs_it->stamp))
+    {
+      if ((now - range_msgs_it->stamp).toSec() > pending_timeout_)
+        dropped_readings_++;
+      else
+      {
+        deferred_readings_++;
+        pending_readings_.push_back(*range_msgs_it);
+      }
+      continue;
+    }
+
+    *ready++ = *range_msgs_it;
+  }
+  cycle_readings_.erase(ready, cycle_readings_.end());
+
+  coalesceReadings(cycle_readings_);
+
+  for (std::vector<RangeReading>::iterator range_msgs_it = cycle_readings_.begin();
+      range_msgs_it != cycle_readings_.end(); range_msgs_it++)
     processRangeMessageFunc_(*range_msgs_it);
+  cycle_readings_.clear();
+
+  integrateCones();
+
+  if (integrate_scans_)
+    integrateScans(now);
+
+  if (overflowed_readings_ > 0)
+    ROS_WARN_THROTTLE(1.0, "%s: incoming range queue overflowed, %lu readings lost", name_.c_str(),
+                      overflowed_readings_);
+
+  if (dropped_readings_ > 0)
+    ROS_WARN_THROTTLE(1.0, "%s: dropped %u range readings whose transform to %s did not arrive within %.2f seconds",
+                      name_.c_str(), dropped_readings_, global_frame_.c_str(), pending_timeout_);
+  if (deferred_readings_ > 0)
+    ROS_DEBUG("%s: deferred %u range readings waiting for their transform", name_.c_str(), deferred_readings_);
+  if (coalesced_readings_ > 0)
+    ROS_DEBUG("%s: folded %u range readings into earlier ones of the same sensor", name_.c_str(), coalesced_readings_);
+}
+
+void RangeSensorLayer::coalesceReadings(std::vector<RangeReading>& readings)
+{
+  coalesced_readings_ = 0;
+  if (coalesce_policy_ == COALESCE_NONE)
+    return;
+
+  // Index into readings of each sensor's open group, or -1
+  coalesce_groups_.assign(sensor_frame_count_.load(boost::memory_order_acquire), -1);
+
+  std::vector<RangeReading>::iterator out = readings.begin();
+  for (std::vector<RangeReading>::iterator it = readings.begin(); it != readings.end(); ++it)
+  {
+    int& group = coalesce_groups_[it->sensor];
+    if (group >= 0)
+    {
+      RangeReading& fused = readings[group];
+
+      if (coalesce_policy_ == COALESCE_LATEST)
+      {
+        fused = *it;
+        coalesced_readings_++;
+        continue;
+      }
+
+      // Only fold readings that describe the same return: equal ranges (this covers the
+      // +-Inf of fixed rangers and max readings), or in-range ones less than a cell apart
+      bool in_range = it->range >= it->min_range && it->range < it->max_range &&
+                      fused.range >= fused.min_range && fused.range < fused.max_range;
+      if (it->range == fused.range || (in_range && fabs(it->range - fused.range) <= resolution_))
+      {
+        // Independent observations of one range: the cone goes in once, at their mean,
+        // with the evidence of all of them. Equal ranges keep theirs, which also keeps
+        // the +-Inf of fixed rangers from turning into NaN.
+        if (it->range != fused.range)
+          fused.range += (it->range - fused.range) / (fused.weight + 1);
+        fused.stamp = it->stamp;
+        fused.weight++;
+        coalesced_readings_++;
+        continue;
+      }
+    }
+
+    group = out - readings.begin();
+    *out++ = *it;
   }
+  readings.erase(out, readings.end());
 }
 
-void RangeSensorLayer::processRangeMsg(sensor_msgs::Range& range_message)
+void RangeSensorLayer::processRangeMsg(RangeReading& range_message)
 {
   if (range_message.min_range == range_message.max_range)
     processFixedRangeMsg(range_message);
@@ -253,13 +603,13 @@ void RangeSensorLayer::processRangeMsg(sensor_msgs::Range& range_message)
     processVariableRangeMsg(range_message);
 }
 
-void RangeSensorLayer::processFixedRangeMsg(sensor_msgs::Range& range_message)
+void RangeSensorLayer::processFixedRangeMsg(RangeReading& range_message)
 {
   if (!isinf(range_message.range))
   {
     ROS_ERROR_THROTTLE(1.0,
         "Fixed distance ranger (min_range == max_range) in frame %s sent invalid value. Only -Inf (== object detected) and Inf (== no object detected) are valid.",
-        range_message.header.frame_id.c_str());
+        sensorFrame(range_message.sensor).c_str());
     return;
   }
 
@@ -278,131 +628,648 @@ void RangeSensorLayer::processFixedRangeMsg(sensor_msgs::Range& range_message)
   updateCostmap(range_message, clear_sensor_cone);
 }
 
-void RangeSensorLayer::processVariableRangeMsg(sensor_msgs::Range& range_message)
+void RangeSensorLayer::processVariableRangeMsg(RangeReading& range_message)
 {
   if (range_message.range < range_message.min_range ||
       range_message.range > range_message.max_range)
     return;
 
   bool clear_sensor_cone = false;
-  syncCB(range_message);
 
+  // Leave the cone to the laser when it already sees the obstacle
   if ((range_message.range == range_message.max_range && clear_on_max_reading_) ||
-       fusion)
+      laser_fusion_.confirms(range_message.sensor, sensorFrame(range_message.sensor), range_message.stamp,
+                             range_message.field_of_view, range_message.max_range, range_message.range))
     clear_sensor_cone = true;
 
-    updateCostmap(range_message, clear_sensor_cone);
+  updateCostmap(range_message, clear_sensor_cone);
 }
 
-void RangeSensorLayer::updateCostmap(sensor_msgs::Range& range_message, bool clear_sensor_cone)
+void RangeSensorLayer::updateCostmap(RangeReading& range_message, bool clear_sensor_cone)
 {
   max_angle_ = range_message.field_of_view/2;
 
-  geometry_msgs::PointStamped in, out;
-  in.header.stamp = range_message.header.stamp;
-  in.header.frame_id = range_message.header.frame_id;
+  double ox, oy, tx, ty;
+  if (!transformRange(range_message, &ox, &oy, &tx, &ty))
+    return;
 
-  if(!tf_->waitForTransform(global_frame_, in.header.frame_id,
-        in.header.stamp, ros::Duration(0.1)) ) {
-     ROS_ERROR_THROTTLE(1.0, "Range sensor layer can't transform from %s to %s at %f",
-        global_frame_.c_str(), in.header.frame_id.c_str(),
-        in.header.stamp.toSec());
-     return;
+  // calculate target props
+  double dx = tx-ox, dy = ty-oy,
+        theta = atan2(dy,dx), d = sqrt(dx*dx+dy*dy);
+
+  ConeUpdate cone;
+  cone.ox = ox;
+  cone.oy = oy;
+  cone.theta = theta;
+  cone.range = range_message.range;
+  cone.half_angle = max_angle_;
+  cone.clear = clear_sensor_cone;
+  cone.weight = range_message.weight;
+  cone.target_x = cone.target_y = -1;
+  cone.stencil.reset();
+
+  // Far cones have an angular uncertainty much coarser than a cell
+  cone.lod = 1;
+  if (lod_distance_ > 0.0 && range_message.range > lod_distance_)
+    cone.lod = range_message.range > 2 * lod_distance_ ? 4 : 2;
+
+  // Update Map with Target Point
+  unsigned int aa, ab;
+  if(worldToMap(tx, ty, aa, ab)){
+    cone.target_x = aa;
+    cone.target_y = ab;
+    markDirty(ab, aa, aa);
+    touch(tx, ty, &min_x_, &min_y_, &max_x_, &max_y_);
   }
 
-  tf_->transformPoint (global_frame_, in, out);
+  // The sensor model is neutral past phi = r * (1 + resolution_), so only clearing
+  // reaches out to the full 1.2 * d extent
+  double radius = clear_sensor_cone ? d * 1.2 : d * (1 + resolution_);
 
-  double ox = out.point.x, oy = out.point.y;
+  cone.first_span = cone_spans_.size();
+  if (range_message.min_range == range_message.max_range && stencil_heading_bin_ > 0.0)
+  {
+    // Fixed rangers always give the same cone, so it is only shifted into place, by
+    // whole cells
+    cone.stencil = coneStencil(range_message.sensor, cone, radius);
+    appendStencilSpans(*cone.stencil, (int)floor((ox - origin_x_) / resolution_),
+                       (int)floor((oy - origin_y_) / resolution_));
+  }
+  else
+    rasterizeCone((ox - origin_x_) / resolution_, (oy - origin_y_) / resolution_, theta, max_angle_,
+                  radius / resolution_, size_x_, size_y_, cone_spans_);
+  cone.last_span = cone_spans_.size();
+  cone_span_values_.resize(cone_spans_.size(), 0);
+  cone_updates_.push_back(cone);
+
+  // Integer Bounds of Update; spans come out ordered by row
+  int bx0 = size_x_, bx1 = -1;
+  for (unsigned int i = cone.first_span; i < cone.last_span; i++)
+  {
+    const CellSpan& span = cone_spans_[i];
+    markDirty(span.y, span.x0, span.x1);
+    bx0 = std::min(bx0, span.x0);
+    bx1 = std::max(bx1, span.x1);
+  }
 
-  in.point.x = range_message.range;
+  if (cone.first_span < cone.last_span)
+  {
+    int by0 = cone_spans_[cone.first_span].y, by1 = cone_spans_[cone.last_span - 1].y;
+    touch(origin_x_ + bx0 * resolution_, origin_y_ + by0 * resolution_, &min_x_, &min_y_, &max_x_, &max_y_);
+    touch(origin_x_ + (bx1 + 1) * resolution_, origin_y_ + (by1 + 1) * resolution_,
+          &min_x_, &min_y_, &max_x_, &max_y_);
+  }
 
-  tf_->transformPoint(global_frame_, in, out);
+  buffered_readings_++;
+  last_reading_time_ = ros::Time::now();
+}
 
-  double tx = out.point.x, ty = out.point.y;
+unsigned int RangeSensorLayer::storageRuns(int y, int x0, int x1, CellSpan runs[2]) const
+{
+  int sy = y + ring_y_, sx = x0 + ring_x_;
+  if (sy >= (int)size_y_)
+    sy -= size_y_;
+  if (sx >= (int)size_x_)
+    sx -= size_x_;
+
+  int n = x1 - x0 + 1, first = std::min(n, (int)size_x_ - sx);
+  runs[0].y = sy;
+  runs[0].x0 = sx;
+  runs[0].x1 = sx + first - 1;
+  if (first == n)
+    return 1;
+
+  runs[1].y = sy;
+  runs[1].x0 = 0;
+  runs[1].x1 = n - first - 1;
+  return 2;
+}
 
-  // calculate target props
-  double dx = tx-ox, dy = ty-oy,
-        theta = atan2(dy,dx), d = sqrt(dx*dx+dy*dy);
+boost::shared_ptr<const RangeSensorLayer::ConeStencil> RangeSensorLayer::coneStencil(unsigned int sensor,
+                                                                                     const ConeUpdate& cone,
+                                                                                     double radius)
+{
+  boost::shared_ptr<const ConeStencil>& cached = stencils_[2 * sensor + cone.clear];
+  if (cached && cached->half_angle == cone.half_angle && cached->range == cone.range &&
+      fabs(angles::shortest_angular_distance(cached->theta, cone.theta)) <= stencil_heading_bin_)
+    return cached;
+
+  // A new object rather than an update in place, since cones of this cycle may still use
+  // the old one
+  boost::shared_ptr<ConeStencil> stencil(new ConeStencil);
+  stencil->theta = cone.theta;
+  stencil->half_angle = cone.half_angle;
+  stencil->range = cone.range;
+
+  // Rasterized with the sensor at the center of cell (c, c) of a grid just big enough
+  int c = (int)ceil(radius / resolution_) + 1;
+  rasterizeCone(c + 0.5, c + 0.5, cone.theta, cone.half_angle, radius / resolution_, 2 * c + 1, 2 * c + 1,
+                stencil->spans);
+
+  for (std::vector<CellSpan>::iterator span = stencil->spans.begin(); span != stencil->spans.end(); ++span)
+  {
+    span->y -= c;
+    span->x0 -= c;
+    span->x1 -= c;
+    stencil->offsets.push_back(stencil->probs.size());
 
-  // Integer Bounds of Update
-  int bx0, by0, bx1, by1;
+    // Clearing cones are applied without per-cell values
+    for (int x = span->x0; x <= span->x1 && !cone.clear; x++)
+    {
+      double p = cone_model(x * resolution_, span->y * resolution_, cone.theta, cone.range, cone.half_angle);
+      stencil->probs.push_back(p);
+      stencil->log_odds.push_back(log_odds_.logOdds(p));
+    }
+  }
 
-  // Bounds includes the origin
-  worldToMapNoBounds(ox, oy, bx0, by0);
-  bx1 = bx0;
-  by1 = by0;
-  touch(ox, oy, &min_x_, &min_y_, &max_x_, &max_y_);
+  cached = stencil;
+  return cached;
+}
 
-  // Update Map with Target Point
-  unsigned int aa, ab;
-  if(worldToMap(tx, ty, aa, ab)){
-    setCost(aa, ab, 233);
-    touch(tx, ty, &min_x_, &min_y_, &max_x_, &max_y_);
+void RangeSensorLayer::appendStencilSpans(const ConeStencil& stencil, int cx, int cy)
+{
+  for (unsigned int i = 0; i < stencil.spans.size(); i++)
+  {
+    const CellSpan& cell_span = stencil.spans[i];
+    int y = cy + cell_span.y;
+    int x0 = std::max(cx + cell_span.x0, 0), x1 = std::min(cx + cell_span.x1, (int)size_x_ - 1);
+    if (y < 0 || y >= (int)size_y_ || x0 > x1)
+      continue;
+
+    CellSpan span = { y, x0, x1 };
+    cone_spans_.push_back(span);
+    cone_span_values_.push_back(stencil.offsets[i] + x0 - (cx + cell_span.x0));
+  }
+}
+
+void RangeSensorLayer::clearStencils()
+{
+  stencils_.assign(2 * MAX_SENSOR_FRAMES, boost::shared_ptr<const ConeStencil>());
+}
+
+void RangeSensorLayer::markDirty(int y, int x0, int x1)
+{
+  CellSpan runs[2];
+  for (unsigned int k = 0, n = storageRuns(y, x0, x1, runs); k < n; k++)
+  {
+    if (use_log_odds_)
+      log_odds_.markDirty(runs[k].y, runs[k].x0, runs[k].x1);
+    active_tiles_.markDirty(runs[k].y, runs[k].x0, runs[k].x1);
+  }
+}
+
+void RangeSensorLayer::clearMapRows(int y0, int y1, int x0, int x1)
+{
+  CellSpan runs[2];
+  for (int y = y0; y < y1; y++)
+  {
+    for (unsigned int k = 0, n = storageRuns(y, x0, x1 - 1, runs); k < n; k++)
+    {
+      unsigned int len = runs[k].x1 - runs[k].x0 + 1;
+      memset(costmap_ + runs[k].y * size_x_ + runs[k].x0, default_value_, len);
+      if (use_log_odds_)
+        log_odds_.clearRow(runs[k].x0, runs[k].y, len);
+      active_tiles_.markDirty(runs[k].y, runs[k].x0, runs[k].x1);
+    }
+  }
+}
+
+void RangeSensorLayer::integrateCones()
+{
+  if (cone_updates_.empty())
+    return;
+
+  if (cone_updates_.size() > 1 && integration_pool_.size() > 1)
+    integration_pool_.run(boost::bind(&RangeSensorLayer::integrateCones, this, _1, _2));
+  else
+    integrateCones(0, 1);
+
+  cone_updates_.clear();
+  cone_spans_.clear();
+  cone_span_values_.clear();
+}
+
+void RangeSensorLayer::integrateCones(unsigned int worker, unsigned int workers)
+{
+  // Rows are owned by tile band, and every worker walks the cones in reading order, so
+  // each cell sees its updates in the same order as a serial pass
+  ConeScratch& scratch = cone_scratch_[worker];
+  std::vector<float>& row_log_odds = scratch.row_log_odds;
+  // Cones of this cycle may reuse the addresses of the last one's
+  scratch.cone = NULL;
+
+  for (std::vector<ConeUpdate>::const_iterator cone = cone_updates_.begin(); cone != cone_updates_.end(); ++cone)
+  {
+    CellSpan runs[2];
+
+    if (cone->target_y >= 0 && (cone->target_y >> ActiveTileMap::TILE_SHIFT) % workers == worker)
+    {
+      storageRuns(cone->target_y, cone->target_x, cone->target_x, runs);
+      if (use_log_odds_)
+        log_odds_.set(runs[0].x0, runs[0].y, to_prob(233));
+      else
+      {
+        unsigned int one = 1;
+        *storageCells(runs[0].x0, runs[0].y, &one) = 233;
+      }
+    }
+
+    // Coalesced readings count once per reading folded in
+    float weight = cone->weight;
+
+    for (unsigned int i = cone->first_span; i < cone->last_span; i++)
+    {
+      const CellSpan& span = cone_spans_[i];
+      if ((span.y >> ActiveTileMap::TILE_SHIFT) % workers != worker)
+        continue;
+
+      // Where the span lives in storage; it only splits when it wraps around
+      unsigned int pieces = storageRuns(span.y, span.x0, span.x1, runs);
+      unsigned int n = span.x1 - span.x0 + 1, n0 = runs[0].x1 - runs[0].x0 + 1;
+
+      if (cone->clear)
+      {
+        clearRuns(runs, pieces, weight);
+        continue;
+      }
+
+      // Offset of the cell center from the sensor origin, stepped along the row
+      double px = origin_x_ + (span.x0 + 0.5) * resolution_ - cone->ox;
+      double py = origin_y_ + (span.y + 0.5) * resolution_ - cone->oy;
+
+      // Model values for the span's cells when they do not come from cone_model() one by
+      // one: precomputed for a stencil cone, or sampled per block for a far one
+      const float* probs = NULL;
+      const float* log_odds = NULL;
+      if (cone->stencil)
+      {
+        probs = &cone->stencil->probs[0] + cone_span_values_[i];
+        log_odds = &cone->stencil->log_odds[0] + cone_span_values_[i];
+      }
+      else if (cone->lod > 1)
+        probs = lodRow(scratch, *cone, span);
+
+      if (use_log_odds_)
+      {
+        row_log_odds.resize(n);
+        for (unsigned int k = 0; k < n; k++, px += resolution_)
+          row_log_odds[k] = weight * (log_odds ? log_odds[k] : log_odds_.logOdds(probs ? probs[k] :
+                                      cone_model(px, py, cone->theta, cone->range, cone->half_angle)));
+        log_odds_.addRow(runs[0].x0, runs[0].y, &row_log_odds[0], n0);
+        if (pieces > 1)
+          log_odds_.addRow(runs[1].x0, runs[1].y, &row_log_odds[n0], n - n0);
+      }
+      else
+      {
+        for (unsigned int k = 0, c = 0; k < pieces; k++)
+        {
+          for (unsigned int x = runs[k].x0, m; x <= (unsigned int)runs[k].x1; x += m)
+          {
+            m = runs[k].x1 - x + 1;
+            unsigned char* cell = storageCells(x, runs[k].y, &m);
+            for (unsigned int j = 0; j < m; j++, c++, px += resolution_)
+              update_cell(cell[j], combine_likelihood(probs ? probs[c] :
+                                                      cone_model(px, py, cone->theta, cone->range, cone->half_angle),
+                                                      cone->weight));
+          }
+        }
+      }
+    }
+  }
+}
+
+const float* RangeSensorLayer::lodRow(ConeScratch& scratch, const ConeUpdate& cone, const CellSpan& span)
+{
+  // Blocks never straddle the 16-row bands of the workers, since lod divides 16
+  int lod = cone.lod, block_row = span.y / lod;
+  if (scratch.cone != &cone || scratch.block_row != block_row)
+  {
+    scratch.cone = &cone;
+    scratch.block_row = block_row;
+    scratch.stamp++;
+  }
+  if (scratch.block_stamps.size() < size_x_)
+  {
+    scratch.block_values.resize(size_x_);
+    scratch.block_stamps.resize(size_x_, 0);
+  }
+
+  // The model is evaluated once per block, at its center, and shared by all its cells
+  double py = origin_y_ + (block_row * lod + 0.5 * lod) * resolution_ - cone.oy;
+  unsigned int n = span.x1 - span.x0 + 1;
+  scratch.row_probs.resize(n);
+  for (unsigned int k = 0; k < n; k++)
+  {
+    int block = (span.x0 + k) / lod;
+    if (scratch.block_stamps[block] != scratch.stamp)
+    {
+      double px = origin_x_ + (block * lod + 0.5 * lod) * resolution_ - cone.ox;
+      scratch.block_values[block] = cone_model(px, py, cone.theta, cone.range, cone.half_angle);
+      scratch.block_stamps[block] = scratch.stamp;
+    }
+    scratch.row_probs[k] = scratch.block_values[block];
+  }
+  return &scratch.row_probs[0];
+}
+
+void RangeSensorLayer::clearRuns(const CellSpan* runs, unsigned int pieces, float weight)
+{
+  // The sensor term of a clearing cone is 0 everywhere: in the byte grid the Bayesian
+  // update then leaves 0 whatever the prior, and in log-odds it is one constant step
+  if (use_log_odds_)
+  {
+    float step = weight * log_odds_.logOdds(0.0);
+    for (unsigned int k = 0; k < pieces; k++)
+      log_odds_.addConstant(runs[k].x0, runs[k].y, step, runs[k].x1 - runs[k].x0 + 1);
+    return;
+  }
+
+  for (unsigned int k = 0; k < pieces; k++)
+  {
+    for (unsigned int x = runs[k].x0, m; x <= (unsigned int)runs[k].x1; x += m)
+    {
+      m = runs[k].x1 - x + 1;
+      memset(storageCells(x, runs[k].y, &m), to_cost(0.0), m);
+    }
+  }
+}
+
+void RangeSensorLayer::integrateScans(const ros::Time& now)
+{
+  // Scans still waiting for their transform go first, as with range readings
+  cycle_scans_.swap(pending_scans_);
+  pending_scans_.clear();
+  scan_queue_.drain(cycle_scans_);
+
+  unsigned long queue_overflows = scan_queue_.overflows();
+  unsigned long overflowed = queue_overflows - scan_overflows_seen_;
+  scan_overflows_seen_ = queue_overflows;
+  unsigned int dropped = 0;
+  decimated_beams_ = 0;
+
+  for (unsigned int i = 0; i < cycle_scans_.size(); i++)
+  {
+    const sensor_msgs::LaserScan& scan = *cycle_scans_[i];
+    if (!tf_->canTransform(global_frame_, scan.header.frame_id, scan.header.stamp))
+    {
+      if ((now - scan.header.stamp).toSec() <= pending_timeout_)
+        pending_scans_.push_back(cycle_scans_[i]);
+      else
+        dropped++;
+      continue;
+    }
+    integrateScan(scan);
+  }
+  cycle_scans_.clear();
+
+  if (overflowed > 0)
+    ROS_WARN_THROTTLE(1.0, "%s: incoming scan queue overflowed, %lu laser scans lost", name_.c_str(), overflowed);
+  if (dropped > 0)
+    ROS_WARN_THROTTLE(1.0, "%s: dropped %u laser scans whose transform to %s did not arrive within %.2f seconds",
+                      name_.c_str(), dropped, global_frame_.c_str(), pending_timeout_);
+  if (decimated_beams_ > 0)
+    ROS_DEBUG("%s: decimated %u laser beams ending in the cell of their neighbour", name_.c_str(),
+              decimated_beams_);
+}
+
+void RangeSensorLayer::integrateScan(const sensor_msgs::LaserScan& scan)
+{
+  // One transform for the whole scan
+  tf::StampedTransform transform;
+  try
+  {
+    tf_->lookupTransform(global_frame_, scan.header.frame_id, scan.header.stamp, transform);
+  }
+  catch (tf::TransformException& ex)
+  {
+    ROS_ERROR_THROTTLE(1.0, "Range sensor layer can't transform from %s to %s: %s", global_frame_.c_str(),
+                       scan.header.frame_id.c_str(), ex.what());
+    return;
   }
 
-  double mx, my;
-  int a, b;
-
-  // Update left side of sonar cone
-  mx = ox + cos(theta-max_angle_) * d * 1.2;
-  my = oy + sin(theta-max_angle_) * d * 1.2;
-  worldToMapNoBounds(mx, my, a, b);
-  bx0 = std::min(bx0, a);
-  bx1 = std::max(bx1, a);
-  by0 = std::min(by0, b);
-  by1 = std::max(by1, b);
-  touch(mx, my, &min_x_, &min_y_, &max_x_, &max_y_);
-
-  // Update right side of sonar cone
-  mx = ox + cos(theta+max_angle_) * d * 1.2;
-  my = oy + sin(theta+max_angle_) * d * 1.2;
-
-  worldToMapNoBounds(mx, my, a, b);
-  bx0 = std::min(bx0, a);
-  bx1 = std::max(bx1, a);
-  by0 = std::min(by0, b);
-  by1 = std::max(by1, b);
-  touch(mx, my, &min_x_, &min_y_, &max_x_, &max_y_);
-
-  // Limit Bounds to Grid
-  bx0 = std::max(0, bx0);
-  by0 = std::max(0, by0);
-  bx1 = std::min((int)size_x_, bx1);
-  by1 = std::min((int)size_y_, by1);
-
-  for(unsigned int x=bx0; x<=(unsigned int)bx1; x++){
-    for(unsigned int y=by0; y<=(unsigned int)by1; y++){
-      double wx, wy;
-      mapToWorld(x,y,wx,wy);
-      update_cell(ox, oy, theta, range_message.range, wx, wy, clear_sensor_cone);
+  // Laser x and y axes in the global frame
+  tf::Vector3 ux = transform.getBasis().getColumn(0), uy = transform.getBasis().getColumn(1);
+  double lx = transform.getOrigin().x(), ly = transform.getOrigin().y();
+  scan_beams_.setGeometry(scan.angle_min, scan.angle_increment, scan.ranges.size());
+  scan_beams_.endpoints(scan.ranges, scan.range_max, lx, ly, ux.x(), uy.x(), ux.y(), uy.y(), scan_ex_, scan_ey_);
+
+  int cx = (int)floor((lx - origin_x_) / resolution_), cy = (int)floor((ly - origin_y_) / resolution_);
+  double min_x = lx, min_y = ly, max_x = lx, max_y = ly;
+  int last_x = cx, last_y = cy;
+
+  for (unsigned int i = 0; i < scan_ex_.size(); i++)
+  {
+    float range = scan.ranges[i];
+    if (!(range >= scan.range_min))
+      continue;
+
+    // A beam ending in the same cell as the one before it retraces the same cells, which
+    // happens wherever the scan is denser than the grid
+    int ex = (int)floor((scan_ex_[i] - origin_x_) / resolution_);
+    int ey = (int)floor((scan_ey_[i] - origin_y_) / resolution_);
+    if (ex == last_x && ey == last_y)
+    {
+      decimated_beams_++;
+      continue;
     }
+    last_x = ex;
+    last_y = ey;
+
+    traceBeam(cx, cy, ex, ey, range < scan.range_max);
+
+    min_x = std::min(min_x, (double)scan_ex_[i]);
+    min_y = std::min(min_y, (double)scan_ey_[i]);
+    max_x = std::max(max_x, (double)scan_ex_[i]);
+    max_y = std::max(max_y, (double)scan_ey_[i]);
   }
 
+  touch(min_x, min_y, &min_x_, &min_y_, &max_x_, &max_y_);
+  touch(max_x + resolution_, max_y + resolution_, &min_x_, &min_y_, &max_x_, &max_y_);
   buffered_readings_++;
   last_reading_time_ = ros::Time::now();
 }
 
-void RangeSensorLayer::update_cell(double ox, double oy, double ot, double r, double nx, double ny, bool clear)
+void RangeSensorLayer::traceBeam(int x0, int y0, int x1, int y1, bool hit)
+{
+  // Bresenham from the laser cell up to, not including, the endpoint cell; consecutive
+  // cells of a row are marked dirty as one run
+  int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+  int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+  int err = dx + dy;
+  int x = x0, y = y0;
+  int run_y = -1, run_x0 = 0, run_x1 = -1;
+  bool inside = false;
+
+  float miss_log_odds = log_odds_.logOdds(scan_miss_probability_);
+  while (x != x1 || y != y1)
+  {
+    if (x >= 0 && y >= 0 && x < (int)size_x_ && y < (int)size_y_)
+    {
+      inside = true;
+      updateScanCell(x, y, miss_log_odds, scan_miss_probability_);
+      if (y == run_y && x == run_x1 + 1)
+        run_x1 = x;
+      else if (y == run_y && x == run_x0 - 1)
+        run_x0 = x;
+      else
+      {
+        if (run_y >= 0)
+          markDirty(run_y, run_x0, run_x1);
+        run_y = y;
+        run_x0 = run_x1 = x;
+      }
+    }
+    else if (inside)
+      break;  // a straight beam does not come back onto the grid
+
+    int e2 = 2 * err;
+    if (e2 >= dy)
+    {
+      err += dy;
+      x += sx;
+    }
+    if (e2 <= dx)
+    {
+      err += dx;
+      y += sy;
+    }
+  }
+  if (run_y >= 0)
+    markDirty(run_y, run_x0, run_x1);
+
+  if (hit && x1 >= 0 && y1 >= 0 && x1 < (int)size_x_ && y1 < (int)size_y_)
+  {
+    updateScanCell(x1, y1, log_odds_.logOdds(scan_hit_probability_), scan_hit_probability_);
+    markDirty(y1, x1, x1);
+  }
+}
+
+void RangeSensorLayer::updateScanCell(int x, int y, float log_odds, double p)
 {
-  unsigned int x, y;
-  if(worldToMap(nx, ny, x, y)){
-    double dx = nx-ox, dy = ny-oy;
-    double theta = atan2(dy, dx) - ot;
-    theta = angles::normalize_angle(theta);
-    double phi = sqrt(dx*dx+dy*dy);
-    double sensor = 0.0;
-    if(!clear)
-        sensor = sensor_model(r,phi,theta);
-    double prior = to_prob(getCost(x,y));
-    double prob_occ = sensor * prior;
-    double prob_not = (1 - sensor) * (1 - prior);
-    double new_prob = prob_occ/(prob_occ+prob_not);
+  CellSpan runs[2];
+  storageRuns(y, x, x, runs);
+  if (use_log_odds_)
+    log_odds_.addConstant(runs[0].x0, runs[0].y, log_odds, 1);
+  else
+  {
+    unsigned int one = 1;
+    update_cell(*storageCells(runs[0].x0, runs[0].y, &one), p);
+  }
+}
+
+bool RangeSensorLayer::canTransformRange(unsigned int sensor, const ros::Time& stamp)
+{
+  if (!static_sensor_transforms_)
+    return tf_->canTransform(global_frame_, sensorFrame(sensor), stamp);
 
-    //ROS_INFO("%f %f | %f %f = %f", dx, dy, theta, phi, sensor);
-    //ROS_INFO("%f | %f %f | %f", prior, prob_occ, prob_not, new_prob);
-      unsigned char c = to_cost(new_prob);
-      setCost(x,y,c);
+  if (!base_transform_valid_)
+    return false;
+  SensorMount& mount = sensor_mounts_[sensor];
+  if (mount.cached)
+    return true;
+
+  tf::StampedTransform transform;
+  try
+  {
+    tf_->lookupTransform(base_frame_, sensorFrame(sensor), ros::Time(0), transform);
+  }
+  catch (tf::TransformException&)
+  {
+    return false;
   }
+
+  mount.mount = transform;
+  mount.cached = true;
+  updateSensorPose(mount);
+  ROS_DEBUG("%s: cached the mounting transform of %s", name_.c_str(), sensorFrame(sensor).c_str());
+  return true;
+}
+
+void RangeSensorLayer::updateSensorPose(SensorMount& sensor)
+{
+  tf::Transform pose = base_transform_ * sensor.mount;
+  tf::Vector3 axis = pose.getBasis().getColumn(0);
+  sensor.ox = pose.getOrigin().x();
+  sensor.oy = pose.getOrigin().y();
+  sensor.ux = axis.x();
+  sensor.uy = axis.y();
+}
+
+bool RangeSensorLayer::transformRange(const RangeReading& range_message, double* ox, double* oy,
+                                      double* tx, double* ty)
+{
+  if (static_sensor_transforms_)
+  {
+    const SensorMount& sensor = sensor_mounts_[range_message.sensor];
+    if (!sensor.cached)
+      return false;
+
+    *ox = sensor.ox;
+    *oy = sensor.oy;
+    *tx = sensor.ox + range_message.range * sensor.ux;
+    *ty = sensor.oy + range_message.range * sensor.uy;
+    return true;
+  }
+
+  geometry_msgs::PointStamped in, out;
+  in.header.stamp = range_message.stamp;
+  in.header.frame_id = sensorFrame(range_message.sensor);
+
+  try
+  {
+    tf_->transformPoint (global_frame_, in, out);
+
+    *ox = out.point.x;
+    *oy = out.point.y;
+
+    in.point.x = range_message.range;
+
+    tf_->transformPoint(global_frame_, in, out);
+
+    *tx = out.point.x;
+    *ty = out.point.y;
+  }
+  catch (tf::TransformException& ex)
+  {
+     ROS_ERROR_THROTTLE(1.0, "Range sensor layer can't transform from %s to %s at %f: %s",
+        global_frame_.c_str(), in.header.frame_id.c_str(),
+        in.header.stamp.toSec(), ex.what());
+     return false;
+  }
+  return true;
+}
+
+double RangeSensorLayer::cone_model(double dx, double dy, double ot, double r, double max_angle)
+{
+  // both angles are in [-pi, pi], so a single wrap normalizes the difference
+  double theta = atan2(dy, dx) - ot;
+  if(theta > M_PI)
+      theta -= 2 * M_PI;
+  else if(theta < -M_PI)
+      theta += 2 * M_PI;
+  double phi = sqrt(dx*dx+dy*dy);
+  return exact_sensor_model_ ? sensor_model(r,phi,theta,max_angle) : sensor_model_lookup(r,phi,theta,max_angle);
+}
+
+double RangeSensorLayer::combine_likelihood(double sensor, unsigned int weight)
+{
+  if (weight <= 1)
+    return sensor;
+
+  // Same as applying the reading weight times: the odds multiply
+  double occ = std::pow(sensor, (int)weight), free = std::pow(1 - sensor, (int)weight);
+  return occ / (occ + free);
+}
+
+void RangeSensorLayer::update_cell(unsigned char& cell, double sensor)
+{
+  double prior = to_prob(cell);
+  double prob_occ = sensor * prior;
+  double prob_not = (1 - sensor) * (1 - prior);
+  double new_prob = prob_occ/(prob_occ+prob_not);
+
+  //ROS_INFO("%f | %f %f | %f", prior, prob_occ, prob_not, new_prob);
+  cell = to_cost(new_prob);
 }
 
 void RangeSensorLayer::updateBounds(double robot_x, double robot_y, double robot_yaw, double* min_x,
@@ -411,7 +1278,12 @@ void RangeSensorLayer::updateBounds(double robot_x, double robot_y, double robot
   if (layered_costmap_->isRolling())
     updateOrigin(robot_x - getSizeInMetersX() / 2, robot_y - getSizeInMetersY() / 2);
 
-  updateCostmap();
+  boost::unique_lock<mutex_t> lock(*getMutex());
+
+  // In async mode the integration thread has already done the work; only collect the
+  // bounds it accumulated
+  if (!async_integration_)
+    updateCostmap();
 
   *min_x = std::min(*min_x, min_x_);
   *min_y = std::min(*min_y, min_y_);
@@ -419,7 +1291,7 @@ void RangeSensorLayer::updateBounds(double robot_x, double robot_y, double robot
   *max_y = std::max(*max_y, max_y_);
 
   min_x_ = min_y_ = std::numeric_limits<double>::max();
-  max_x_ = max_y_ = std::numeric_limits<double>::min();
+  max_x_ = max_y_ = -std::numeric_limits<double>::max();
 
   if (!enabled_)
   {
@@ -444,38 +1316,59 @@ void RangeSensorLayer::updateBounds(double robot_x, double robot_y, double robot
 void RangeSensorLayer::updateCosts(costmap_2d::Costmap2D& master_grid, int min_i, int min_j, int max_i,
                                           int max_j)
 {
+  unsigned char clear = to_cost(clear_threshold_), mark = to_cost(mark_threshold_);
+
+  // Held through the merge, since the integration thread may be writing costmap_
+  boost::unique_lock<mutex_t> lock(*getMutex());
+  if (use_log_odds_)
+    log_odds_.flush(costmap_);
+  if (sparse_storage_)
+    active_tiles_.refresh(sparse_costs_, clear, mark);
+  else
+    active_tiles_.refresh(costmap_, clear, mark);
+
   if (!enabled_)
     return;
 
   unsigned char* master_array = master_grid.getCharMap();
   unsigned int span = master_grid.getSizeInCellsX();
-  unsigned char clear = to_cost(clear_threshold_), mark = to_cost(mark_threshold_);
+  const unsigned int shift = ActiveTileMap::TILE_SHIFT;
 
-  for (int j = min_j; j < max_j; j++)
+  // The master window is reset before every layer, so all contributing cells inside it
+  // are written again; only tiles holding such cells are visited
+  for (int j = min_j; j < max_j && min_i < max_i; j++)
   {
-    unsigned int it = j * span + min_i;
-    for (int i = min_i; i < max_i; i++)
-    {
-      unsigned char prob = costmap_[it];
-      unsigned char current;
-      if(prob==costmap_2d::NO_INFORMATION){
-        it++;
-        continue;
-      }
-      else if(prob>mark)
-        current = costmap_2d::LETHAL_OBSTACLE;
-      else if(prob<clear)
-        current = costmap_2d::FREE_SPACE;
-      else{
-        it++;
-        continue;
-      }
+    unsigned char* master_row = master_array + j * span;
 
-      unsigned char old_cost = master_array[it];
+    CellSpan runs[2];
+    int i = min_i;
+    for (unsigned int k = 0, n = storageRuns(j, min_i, max_i - 1, runs); k < n; k++)
+    {
+      unsigned int ty = runs[k].y >> shift;
+      int x0 = runs[k].x0, x1 = runs[k].x1 + 1, offset = i - x0;  // master column - storage column
+      i += x1 - x0;
 
-      if (old_cost == NO_INFORMATION || old_cost < current)
-        master_array[it] = current;
-      it++;
+      for (int tx = x0 >> shift; tx << shift < x1;)
+      {
+        if (!active_tiles_.active(tx, ty))
+        {
+          tx++;
+          continue;
+        }
+
+        // Merge a run of adjacent active tiles
+        int a = std::max(x0, tx << shift);
+        while (tx << shift < x1 && active_tiles_.active(tx, ty))
+          tx++;
+        int b = std::min(x1, tx << shift);
+
+        // Sparse tiles are not adjacent in memory, so those go one at a time
+        for (int c = a, e; c < b; c = e)
+        {
+          e = sparse_storage_ ? std::min(b, ((c >> shift) + 1) << shift) : b;
+          mergeThresholdedRow(storageRow(c, runs[k].y), master_row + c + offset, e - c, clear, mark);
+        }
+      }
     }
   }
 
@@ -483,23 +1376,155 @@ void RangeSensorLayer::updateCosts(costmap_2d::Costmap2D& master_grid, int min_i
   current_ = true;
 }
 
+unsigned char* RangeSensorLayer::storageCells(unsigned int x, unsigned int y, unsigned int* n)
+{
+  if (!sparse_storage_)
+    return costmap_ + y * size_x_ + x;
+
+  *n = std::min(*n, SparseTileGrid::TILE_SIZE - (x & (SparseTileGrid::TILE_SIZE - 1)));
+  return sparse_costs_.row(x, y);
+}
+
+const unsigned char* RangeSensorLayer::storageRow(unsigned int x, unsigned int y) const
+{
+  return sparse_storage_ ? sparse_costs_.peek(x, y) : costmap_ + y * size_x_ + x;
+}
+
+void RangeSensorLayer::initMaps(unsigned int size_x, unsigned int size_y)
+{
+  if (!sparse_storage_)
+  {
+    CostmapLayer::initMaps(size_x, size_y);
+    return;
+  }
+
+  // The dense array is never allocated; all cells live in sparse_costs_
+  boost::unique_lock<mutex_t> lock(*getMutex());
+  delete[] costmap_;
+  costmap_ = NULL;
+  sparse_costs_.resize(size_x, size_y, default_value_);
+}
+
+void RangeSensorLayer::resetMaps()
+{
+  if (!sparse_storage_)
+  {
+    CostmapLayer::resetMaps();
+    return;
+  }
+
+  boost::unique_lock<mutex_t> lock(*getMutex());
+  sparse_costs_.reset();
+}
+
+void RangeSensorLayer::matchSize()
+{
+  // The integration thread must not see the grid, tiles and tables at different sizes
+  boost::unique_lock<mutex_t> lock(*getMutex());
+  CostmapLayer::matchSize();
+
+  if (use_log_odds_)
+    log_odds_.resize(size_x_, size_y_);
+  active_tiles_.resize(size_x_, size_y_);
+  ring_x_ = ring_y_ = 0;
+  clearStencils();
+
+  // The tables are first built by reconfigureCB(), once phi is known
+  if (dsrv_)
+    buildSensorModelTables();
+}
+
+void RangeSensorLayer::updateOrigin(double new_origin_x, double new_origin_y)
+{
+  boost::unique_lock<mutex_t> lock(*getMutex());
+
+  if (toroidal_storage_)
+  {
+    rotateOrigin(new_origin_x, new_origin_y);
+    return;
+  }
+
+  // Same cell offset Costmap2D::updateOrigin() moves costmap_ by
+  int cell_ox = int((new_origin_x - origin_x_) / resolution_);
+  int cell_oy = int((new_origin_y - origin_y_) / resolution_);
+
+  // Shifted cells no longer line up with the tile state
+  active_tiles_.shift(cell_ox, cell_oy);
+
+  if (!use_log_odds_)
+  {
+    CostmapLayer::updateOrigin(new_origin_x, new_origin_y);
+    return;
+  }
+
+  log_odds_.flush(costmap_);
+  CostmapLayer::updateOrigin(new_origin_x, new_origin_y);
+  log_odds_.shift(cell_ox, cell_oy);
+}
+
+void RangeSensorLayer::rotateOrigin(double new_origin_x, double new_origin_y)
+{
+  // Same cell offset and snapped origin as Costmap2D::updateOrigin()
+  int cell_ox = int((new_origin_x - origin_x_) / resolution_);
+  int cell_oy = int((new_origin_y - origin_y_) / resolution_);
+  origin_x_ += cell_ox * resolution_;
+  origin_y_ += cell_oy * resolution_;
+
+  if (cell_ox == 0 && cell_oy == 0)
+    return;
+
+  int size_x = size_x_, size_y = size_y_;
+  if (abs(cell_ox) >= size_x || abs(cell_oy) >= size_y)
+  {
+    clearMapRows(0, size_y, 0, size_x);
+    return;
+  }
+
+  // Map cell (x, y) is now what (x + cell_ox, y + cell_oy) was, so only the offsets move
+  ring_x_ = (ring_x_ + cell_ox + size_x) % size_x;
+  ring_y_ = (ring_y_ + cell_oy + size_y) % size_y;
+
+  // and the strips that came into view start over from the prior
+  if (cell_oy > 0)
+    clearMapRows(size_y - cell_oy, size_y, 0, size_x);
+  else if (cell_oy < 0)
+    clearMapRows(0, -cell_oy, 0, size_x);
+
+  if (cell_ox > 0)
+    clearMapRows(0, size_y, size_x - cell_ox, size_x);
+  else if (cell_ox < 0)
+    clearMapRows(0, size_y, 0, -cell_ox);
+}
+
 void RangeSensorLayer::reset()
 {
   ROS_DEBUG("Reseting range sensor layer...");
+  boost::unique_lock<mutex_t> lock(*getMutex());
   deactivate();
   resetMaps();
+  if (use_log_odds_)
+    log_odds_.reset();
+  active_tiles_.markAllDirty();
   current_ = true;
   activate();
 }
 
 void RangeSensorLayer::deactivate()
 {
-  range_msgs_buffer_.clear();
+  boost::unique_lock<mutex_t> lock(*getMutex());
+  range_queue_.clear();
+  pending_readings_.clear();
+  pending_scans_.clear();
+  scan_queue_.clear();
 }
 
 void RangeSensorLayer::activate()
 {
-  range_msgs_buffer_.clear();
+  boost::unique_lock<mutex_t> lock(*getMutex());
+  range_queue_.clear();
+  pending_readings_.clear();
+  pending_scans_.clear();
+  scan_queue_.clear();
 }
 
 } // end namespace
@@ -0,0 +1,52 @@
+#include <range_sensor_layer/scan_beams.h>
+#include <algorithm>
+#include <cmath>
+
+namespace range_sensor_layer
+{
+
+ScanBeams::ScanBeams() : angle_min_(0.0), angle_increment_(0.0) {}
+
+void ScanBeams::setGeometry(float angle_min, float angle_increment, unsigned int beams)
+{
+  if (angle_min == angle_min_ && angle_increment == angle_increment_ && beams == cos_.size())
+    return;
+
+  angle_min_ = angle_min;
+  angle_increment_ = angle_increment;
+  cos_.resize(beams);
+  sin_.resize(beams);
+  for (unsigned int i = 0; i < beams; i++)
+  {
+    double angle = angle_min + i * (double)angle_increment;
+    cos_[i] = cos(angle);
+    sin_[i] = sin(angle);
+  }
+}
+
+void ScanBeams::endpoints(const std::vector<float>& ranges, float max_range, double x, double y, double r00,
+                          double r01, double r10, double r11, std::vector<float>& ex, std::vector<float>& ey) const
+{
+  unsigned int n = std::min(ranges.size(), cos_.size());
+  ex.resize(n);
+  ey.resize(n);
+  if (n == 0)
+    return;
+
+  // Beam directions in the target frame, then the endpoints; plain float loops the
+  // compiler turns into SIMD
+  float fx = x, fy = y, a = r00, b = r01, c = r10, d = r11;
+  const float* co = &cos_[0];
+  const float* si = &sin_[0];
+  const float* range = &ranges[0];
+  float* out_x = &ex[0];
+  float* out_y = &ey[0];
+  for (unsigned int i = 0; i < n; i++)
+  {
+    float r = std::min(range[i], max_range);
+    out_x[i] = fx + r * (a * co[i] + b * si[i]);
+    out_y[i] = fy + r * (c * co[i] + d * si[i]);
+  }
+}
+
+}  // namespace range_sensor_layer
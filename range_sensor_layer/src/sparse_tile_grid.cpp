@@ -0,0 +1,71 @@
+#include <range_sensor_layer/sparse_tile_grid.h>
+#include <cstring>
+
+namespace range_sensor_layer
+{
+
+// Tiles the pool grows by at a time
+const unsigned int POOL_BLOCK_TILES = 64;
+
+SparseTileGrid::SparseTileGrid() :
+    size_x_(0), size_y_(0), tiles_x_(0), tiles_y_(0), fill_(0), fill_row_(TILE_SIZE, 0), allocated_(0)
+{
+}
+
+SparseTileGrid::~SparseTileGrid()
+{
+  for (unsigned int i = 0; i < blocks_.size(); i++)
+    delete[] blocks_[i];
+}
+
+void SparseTileGrid::resize(unsigned int size_x, unsigned int size_y, unsigned char fill)
+{
+  release();
+  size_x_ = size_x;
+  size_y_ = size_y;
+  tiles_x_ = (size_x + TILE_SIZE - 1) >> TILE_SHIFT;
+  tiles_y_ = (size_y + TILE_SIZE - 1) >> TILE_SHIFT;
+  fill_ = fill;
+  fill_row_.assign(TILE_SIZE, fill);
+  tiles_.assign(tiles_x_ * tiles_y_, NULL);
+}
+
+void SparseTileGrid::reset()
+{
+  release();
+}
+
+unsigned char* SparseTileGrid::allocate()
+{
+  boost::mutex::scoped_lock lock(pool_mutex_);
+  if (free_.empty())
+  {
+    unsigned char* block = new unsigned char[POOL_BLOCK_TILES * TILE_CELLS];
+    blocks_.push_back(block);
+    for (unsigned int i = POOL_BLOCK_TILES; i > 0; i--)
+      free_.push_back(block + (i - 1) * TILE_CELLS);
+  }
+
+  unsigned char* tile = free_.back();
+  free_.pop_back();
+  allocated_++;
+
+  // Cells past the map edge in border tiles are never read
+  memset(tile, fill_, TILE_CELLS);
+  return tile;
+}
+
+void SparseTileGrid::release()
+{
+  for (unsigned int i = 0; i < tiles_.size(); i++)
+  {
+    if (tiles_[i])
+    {
+      free_.push_back(tiles_[i]);
+      tiles_[i] = NULL;
+    }
+  }
+  allocated_ = 0;
+}
+
+}  // namespace range_sensor_layer
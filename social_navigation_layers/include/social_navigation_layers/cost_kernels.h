@@ -0,0 +1,17 @@
+#ifndef SOCIAL_NAVIGATION_LAYERS_COST_KERNELS_H_
+#define SOCIAL_NAVIGATION_LAYERS_COST_KERNELS_H_
+
+namespace social_navigation_layers
+{
+  class ProxemicKernel;
+
+  // Raises n cells of a master costmap row to the cost kernel gives them, for offsets
+  // from the person of (dx + i * step, dy). NO_INFORMATION cells, cells behind the
+  // person unless back is set, and cells whose cost is below cutoff are left alone.
+  // Uses AVX2 or SSE2 when the CPU has them, with a single precision exp; the costs
+  // then differ from the scalar loop by at most one unit.
+  void raiseProxemicRow(const ProxemicKernel& kernel, bool back, double cutoff,
+                        double dx, double dy, double step, unsigned char* row, unsigned int n);
+};
+
+#endif
@@ -4,24 +4,102 @@
 #include <social_navigation_layers/social_layer.h>
 #include <dynamic_reconfigure/server.h>
 #include <social_navigation_layers/ProxemicLayerConfig.h>
+#include <social_navigation_layers/cost_kernels.h>
+#include <social_navigation_layers/worker_pool.h>
+#include <boost/shared_ptr.hpp>
+#include <list>
+#include <map>
 
 double gaussian(double x, double y, double x0, double y0, double A, double varx, double vary, double skew);
 double get_radius(double cutoff, double A, double var);
 
 namespace social_navigation_layers
 {
+  // gaussian() around one person, with the rotation into the person's frame and the
+  // inverse covariances folded into a quadratic form once, so that a cell costs a
+  // dot product and a single exp instead of the trig of gaussian(). Evaluated a row
+  // at a time by raiseProxemicRow().
+  class ProxemicKernel
+  {
+    public:
+      ProxemicKernel(double A, double angle, double varx, double vary, double var_back);
+
+      double cosine() const { return cos_; }
+      double sine() const { return sin_; }
+
+    private:
+      friend void raiseProxemicRow(const ProxemicKernel& kernel, bool back, double cutoff,
+                                   double dx, double dy, double step, unsigned char* row, unsigned int n);
+
+      double A_, cos_, sin_;
+      double qxx_, qxy_, qyy_, q_back_;
+  };
+
   class ProxemicLayer : public SocialLayer
   {
     public:
-      ProxemicLayer() { layered_costmap_ = NULL; }
+      ProxemicLayer() : params_generation_(0), stamp_generation_(0), stamp_resolution_(0.0) { layered_costmap_ = NULL; }
 
       virtual void onInitialize();
       virtual void updateBoundsFromPeople(double* min_x, double* min_y, double* max_x, double* max_y);
+      virtual double footprintRadius(double speed);
       virtual void updateCosts(costmap_2d::Costmap2D& master_grid, int min_i, int min_j, int max_i, int max_j);
 
     protected:
+      // The parameters of one configure() call. They are published with
+      // boost::atomic_store, so the costmap thread renders against one consistent set
+      // without a lock.
+      struct Parameters
+      {
+        unsigned long generation;
+        double cutoff, amplitude, covar, factor;
+        unsigned int stamp_cache_size;
+        double stamp_speed_bin, stamp_heading_bin;
+      };
+
+      // Precomputed costs of a person standing at the center cell, for one speed and
+      // heading bin; 0 where the cost is below the cutoff
+      struct Stamp
+      {
+        std::pair<int, int> bin;
+        int radius;  // in cells, around the center
+        std::vector<unsigned char> costs;
+      };
+
       void configure(ProxemicLayerConfig &config, uint32_t level);
-      double cutoff_, amplitude_, covar_, factor_;
+
+      // Raises the cells of the footprint of person k within [min_i, max_i) x [min_j, max_j).
+      // Only touches cells inside that window, so people can be rendered concurrently
+      // into disjoint windows.
+      virtual void renderPerson(costmap_2d::Costmap2D& costmap, const Parameters& params,
+                                const PersonArrays& people, unsigned int k,
+                                int min_i, int min_j, int max_i, int max_j);
+      // Renders the tiles of render_tiles_ with index worker modulo workers
+      void renderTiles(costmap_2d::Costmap2D* costmap, const Parameters* params, const PersonArrays* people,
+                       unsigned int worker, unsigned int workers);
+
+      // Thread safe; the stamp stays valid after it is evicted. The cache starts over
+      // whenever params or res differ from those of the stamps it holds.
+      boost::shared_ptr<const Stamp> lookupStamp(const Parameters& params, double speed, double heading, double res);
+      void blitStamp(costmap_2d::Costmap2D& costmap, const Stamp& stamp, double x, double y,
+                     int min_i, int min_j, int max_i, int max_j);
+
+      boost::shared_ptr<const Parameters> params_;
+      unsigned long params_generation_;
+
+      // Least recently used first at the back
+      std::list<boost::shared_ptr<Stamp> > stamps_;
+      std::map<std::pair<int, int>, std::list<boost::shared_ptr<Stamp> >::iterator> stamp_index_;
+      boost::mutex stamp_mutex_;
+      unsigned long stamp_generation_;
+      double stamp_resolution_;
+
+      // Parallel rendering: the update window is cut into square tiles, each holding the
+      // people whose footprint overlaps it
+      static const int RENDER_TILE = 64;
+      WorkerPool render_pool_;
+      std::vector<std::vector<unsigned int> > render_tiles_;
+      int render_min_i_, render_min_j_, render_max_i_, render_max_j_, render_tiles_x_;
       dynamic_reconfigure::Server<ProxemicLayerConfig>* server_;
       dynamic_reconfigure::Server<ProxemicLayerConfig>::CallbackType f_;
   };
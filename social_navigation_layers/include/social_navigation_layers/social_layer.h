@@ -5,29 +5,57 @@
 #include <costmap_2d/layered_costmap.h>
 #include <people_msgs/People.h>
 #include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 
 namespace social_navigation_layers
 {
+  // The transformed people of one cycle, one array per field, so that renderers only
+  // read the numbers they need
+  struct PersonArrays
+  {
+    std::vector<double> x, y, vx, vy;
+    std::vector<double> heading, speed;  // atan2(vy, vx) and |v|
+    std::vector<double> radius;          // of the cost footprint when filled, see footprintRadius()
+
+    unsigned int size() const { return x.size(); }
+    // Keeps the capacity, so refilling a store does not allocate
+    void clear();
+  };
+
   class SocialLayer : public costmap_2d::Layer
   {
     public:
-      SocialLayer() { layered_costmap_ = NULL; }
+      SocialLayer() : people_buffer_(0) { layered_costmap_ = NULL; }
 
       virtual void onInitialize();
       virtual void updateBounds(double origin_x, double origin_y, double origin_yaw, double* min_x, double* min_y, double* max_x, double* max_y);
       virtual void updateCosts(costmap_2d::Costmap2D& master_grid, int min_i, int min_j, int max_i, int max_j) = 0;
       
       virtual void updateBoundsFromPeople(double* min_x, double* min_y, double* max_x, double* max_y) = 0;
+      // Distance from a person moving at speed beyond which they add no cost
+      virtual double footprintRadius(double speed) = 0;
 
       bool isDiscretized() { return false; }
 
     protected:
-      void peopleCallback(const people_msgs::People& people);
+      void peopleCallback(const people_msgs::PeopleConstPtr& people);
+
+      // updateBounds() fills the store returned by beginPeople() through addPerson(),
+      // then publishes it with publishPeople(). Two stores are used in turn and one is
+      // only reallocated when a reader still holds it, so steady cycles do not allocate.
+      PersonArrays& beginPeople();
+      void addPerson(PersonArrays& people, double x, double y, double vx, double vy);
+      void publishPeople();
+
       ros::Subscriber people_sub_;
-      people_msgs::People people_list_;
-      std::list<people_msgs::Person> transformed_people_;
+      // Immutable snapshots, published with boost::atomic_store and read with
+      // boost::atomic_load. A reader keeps the snapshot it loaded alive and consistent
+      // however long it takes, and never blocks the writer.
+      people_msgs::PeopleConstPtr people_list_;
+      boost::shared_ptr<const PersonArrays> transformed_people_;
+      boost::shared_ptr<PersonArrays> people_buffers_[2];
+      unsigned int people_buffer_;
       ros::Duration people_keep_time_;
-      boost::recursive_mutex lock_;
       tf::TransformListener tf_;
       bool first_time_;
       double last_min_x_, last_min_y_, last_max_x_, last_max_y_;
@@ -0,0 +1,230 @@
+#include <social_navigation_layers/cost_kernels.h>
+#include <social_navigation_layers/proxemic_layer.h>
+#include <costmap_2d/cost_values.h>
+#include <math.h>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SOCIAL_NAVIGATION_LAYERS_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+using costmap_2d::NO_INFORMATION;
+
+namespace social_navigation_layers
+{
+    // The terms of a kernel that stay constant along one row
+    struct ProxemicRow
+    {
+        double A, cutoff;
+        bool back, center;            // center: the person's own cell counts as front
+        double cos, along_y;          // along = dx * cos + along_y
+        double qxx, front_y, front_c; // front exponent = dx * (qxx * dx + front_y) + front_c
+        double q_back, back_c;        // back exponent = q_back * dx * dx + back_c
+        double limit;                 // exponents above this give a cost below cutoff
+    };
+
+    typedef void (*ProxemicRowFunction)(const ProxemicRow&, double, double, unsigned char*, unsigned int);
+
+    static void raiseProxemicRowScalar(const ProxemicRow& r, double dx, double step, unsigned char* row, unsigned int n)
+    {
+        for(unsigned int i=0;i<n;i++, dx += step){
+            unsigned char old_cost = row[i];
+            if(old_cost == NO_INFORMATION)
+                continue;
+
+            double q, along = dx * r.cos + r.along_y;
+            if(along > 0.0 || (along == 0.0 && dx == 0.0 && r.center))
+                q = dx * (r.qxx * dx + r.front_y) + r.front_c;
+            else if(r.back)
+                q = r.q_back * dx * dx + r.back_c;
+            else
+                continue;
+
+            double a = r.A * exp(-q);
+            if(a < r.cutoff)
+                continue;
+            unsigned char cvalue = (unsigned char) a;
+            row[i] = std::max(cvalue, old_cost);
+        }
+    }
+
+#ifdef SOCIAL_NAVIGATION_LAYERS_X86_KERNELS
+    // Both variants evaluate 8 cells at a time and differ only in the float width; exp
+    // is the Cephes single precision polynomial, clamped to the range where exp(-q)
+    // is a normal float.
+
+    // Raises 8 row cells to the costs where mask is set. costs and mask hold 8 int16.
+    __attribute__((target("sse2")))
+    static inline void raiseCells8(unsigned char* row, __m128i costs, __m128i mask)
+    {
+        __m128i old_cost = _mm_loadl_epi64((const __m128i*)row);
+        __m128i cvalue = _mm_packus_epi16(costs, costs);
+        __m128i write = _mm_andnot_si128(_mm_cmpeq_epi8(old_cost, _mm_set1_epi8((char)NO_INFORMATION)),
+                                         _mm_packs_epi16(mask, mask));
+        __m128i raised = _mm_max_epu8(old_cost, cvalue);
+        _mm_storel_epi64((__m128i*)row, _mm_or_si128(_mm_and_si128(write, raised), _mm_andnot_si128(write, old_cost)));
+    }
+
+    __attribute__((target("sse2")))
+    static inline __m128 exp4(__m128 x)
+    {
+        x = _mm_max_ps(_mm_min_ps(x, _mm_set1_ps(88.0f)), _mm_set1_ps(-87.0f));
+
+        // x = n ln2 + r with n = floor(x log2(e) + 1/2)
+        __m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+        __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+        fx = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, fx), _mm_set1_ps(1.0f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+        x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440e-4f)));
+
+        __m128 p = _mm_set1_ps(1.9875691500e-4f);
+        p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(1.3981999507e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(8.3334519073e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(4.1665795894e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(1.6666665459e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(5.0000001201e-1f));
+        p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, x), x), x), _mm_set1_ps(1.0f));
+
+        __m128i n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(127)), 23);
+        return _mm_mul_ps(p, _mm_castsi128_ps(n));
+    }
+
+    // Costs of 4 cells, as int32, and the int32 mask of those to write
+    __attribute__((target("sse2")))
+    static inline __m128i proxemicCosts4(const ProxemicRow& r, __m128 dx, __m128* mask)
+    {
+        __m128 front = _mm_cmpgt_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(r.cos)), _mm_set1_ps(r.along_y)),
+                                    _mm_setzero_ps());
+        if(r.center)
+            front = _mm_or_ps(front, _mm_cmpeq_ps(dx, _mm_setzero_ps()));
+        __m128 qf = _mm_add_ps(_mm_mul_ps(dx, _mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(r.qxx)), _mm_set1_ps(r.front_y))),
+                               _mm_set1_ps(r.front_c));
+        __m128 qb = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(dx, dx), _mm_set1_ps(r.q_back)), _mm_set1_ps(r.back_c));
+        __m128 q = _mm_or_ps(_mm_and_ps(front, qf), _mm_andnot_ps(front, qb));
+        __m128 valid = r.back ? _mm_castsi128_ps(_mm_set1_epi32(-1)) : front;
+
+        *mask = _mm_and_ps(valid, _mm_cmple_ps(q, _mm_set1_ps(r.limit)));
+        if(_mm_movemask_ps(*mask) == 0)
+            return _mm_setzero_si128();
+
+        __m128 a = _mm_mul_ps(_mm_set1_ps(r.A), exp4(_mm_sub_ps(_mm_setzero_ps(), q)));
+        *mask = _mm_and_ps(*mask, _mm_cmpge_ps(a, _mm_set1_ps(r.cutoff)));
+        return _mm_cvttps_epi32(a);
+    }
+
+    __attribute__((target("sse2")))
+    static void raiseProxemicRowSSE2(const ProxemicRow& r, double dx, double step, unsigned char* row, unsigned int n)
+    {
+        const __m128 lanes = _mm_mul_ps(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), _mm_set1_ps(step));
+        const __m128 half = _mm_set1_ps(4.0 * step);
+
+        unsigned int i = 0;
+        for(; i + 8 <= n; i += 8){
+            __m128 lo = _mm_add_ps(_mm_set1_ps(dx + i * step), lanes);
+            __m128 mask_lo, mask_hi;
+            __m128i costs_lo = proxemicCosts4(r, lo, &mask_lo);
+            __m128i costs_hi = proxemicCosts4(r, _mm_add_ps(lo, half), &mask_hi);
+            __m128i mask = _mm_packs_epi32(_mm_castps_si128(mask_lo), _mm_castps_si128(mask_hi));
+            if(_mm_movemask_epi8(mask) == 0)
+                continue;
+            raiseCells8(row + i, _mm_packs_epi32(costs_lo, costs_hi), mask);
+        }
+        raiseProxemicRowScalar(r, dx + i * step, step, row + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256 exp8(__m256 x)
+    {
+        x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(88.0f)), _mm256_set1_ps(-87.0f));
+
+        __m256 fx = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                                  _mm256_set1_ps(0.5f)));
+        x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f)));
+        x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f)));
+
+        __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_add_ps(_mm256_mul_ps(p, x), _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(p, x), x), x), _mm256_set1_ps(1.0f));
+
+        __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(n));
+    }
+
+    __attribute__((target("avx2")))
+    static void raiseProxemicRowAVX2(const ProxemicRow& r, double dx, double step, unsigned char* row, unsigned int n)
+    {
+        const __m256 lanes = _mm256_mul_ps(_mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f),
+                                           _mm256_set1_ps(step));
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 valid = r.back ? _mm256_castsi256_ps(_mm256_set1_epi32(-1)) : zero;
+
+        unsigned int i = 0;
+        for(; i + 8 <= n; i += 8){
+            __m256 x = _mm256_add_ps(_mm256_set1_ps(dx + i * step), lanes);
+            __m256 front = _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(r.cos)),
+                                                       _mm256_set1_ps(r.along_y)), zero, _CMP_GT_OQ);
+            if(r.center)
+                front = _mm256_or_ps(front, _mm256_cmp_ps(x, zero, _CMP_EQ_OQ));
+            __m256 qf = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(r.qxx)),
+                                                                     _mm256_set1_ps(r.front_y))),
+                                      _mm256_set1_ps(r.front_c));
+            __m256 qb = _mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(x, x), _mm256_set1_ps(r.q_back)),
+                                      _mm256_set1_ps(r.back_c));
+            __m256 q = _mm256_blendv_ps(qb, qf, front);
+
+            __m256 mask = _mm256_and_ps(_mm256_or_ps(front, valid),
+                                        _mm256_cmp_ps(q, _mm256_set1_ps(r.limit), _CMP_LE_OQ));
+            if(_mm256_movemask_ps(mask) == 0)
+                continue;
+
+            __m256 a = _mm256_mul_ps(_mm256_set1_ps(r.A), exp8(_mm256_sub_ps(zero, q)));
+            mask = _mm256_and_ps(mask, _mm256_cmp_ps(a, _mm256_set1_ps(r.cutoff), _CMP_GE_OQ));
+
+            __m256i costs = _mm256_cvttps_epi32(a);
+            __m256i mask32 = _mm256_castps_si256(mask);
+            raiseCells8(row + i, _mm_packs_epi32(_mm256_castsi256_si128(costs), _mm256_extracti128_si256(costs, 1)),
+                        _mm_packs_epi32(_mm256_castsi256_si128(mask32), _mm256_extracti128_si256(mask32, 1)));
+        }
+        raiseProxemicRowScalar(r, dx + i * step, step, row + i, n - i);
+    }
+#endif
+
+    static ProxemicRowFunction selectProxemicRow()
+    {
+#ifdef SOCIAL_NAVIGATION_LAYERS_X86_KERNELS
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return raiseProxemicRowAVX2;
+        if(__builtin_cpu_supports("sse2"))
+            return raiseProxemicRowSSE2;
+#endif
+        return raiseProxemicRowScalar;
+    }
+
+    void raiseProxemicRow(const ProxemicKernel& kernel, bool back, double cutoff,
+                          double dx, double dy, double step, unsigned char* row, unsigned int n)
+    {
+        static const ProxemicRowFunction raise_row = selectProxemicRow();
+
+        ProxemicRow r;
+        r.A = kernel.A_;
+        r.cutoff = cutoff;
+        r.back = back;
+        r.center = dy == 0.0 && kernel.cos_ > 0.0;
+        r.cos = kernel.cos_;
+        r.along_y = dy * kernel.sin_;
+        r.qxx = kernel.qxx_;
+        r.front_y = dy * kernel.qxy_;
+        r.front_c = dy * dy * kernel.qyy_;
+        r.q_back = kernel.q_back_;
+        r.back_c = dy * dy * kernel.q_back_;
+        // With some slack for the single precision exponent
+        r.limit = log(kernel.A_ / cutoff) * (1.0 + 1e-5) + 1e-5;
+        raise_row(r, dx, step, row, n);
+    }
+};
@@ -26,6 +26,17 @@ double get_radius(double cutoff, double A, double var){
 
 namespace social_navigation_layers
 {
+    ProxemicKernel::ProxemicKernel(double A, double angle, double varx, double vary, double var_back)
+        : A_(A), cos_(cos(angle)), sin_(sin(angle))
+    {
+        // mx^2/(2 varx) + my^2/(2 vary) with mx, my the offset rotated by -angle
+        double ix = 1.0 / (2.0 * varx), iy = 1.0 / (2.0 * vary);
+        qxx_ = cos_ * cos_ * ix + sin_ * sin_ * iy;
+        qyy_ = sin_ * sin_ * ix + cos_ * cos_ * iy;
+        qxy_ = 2.0 * cos_ * sin_ * (ix - iy);
+        q_back_ = 1.0 / (2.0 * var_back);
+    }
+
     void ProxemicLayer::onInitialize()
     {
         SocialLayer::onInitialize();
@@ -33,123 +44,263 @@ namespace social_navigation_layers
         server_ = new dynamic_reconfigure::Server<ProxemicLayerConfig>(nh);
         f_ = boost::bind(&ProxemicLayer::configure, this, _1, _2);
         server_->setCallback(f_);
+
+        int render_threads;
+        nh.param("render_threads", render_threads, 0);
+        render_pool_.start(std::max(render_threads, 0));
     }
     
     void ProxemicLayer::updateBoundsFromPeople(double* min_x, double* min_y, double* max_x, double* max_y)
     {
-        std::list<people_msgs::Person>::iterator p_it;
+        boost::shared_ptr<const PersonArrays> people = boost::atomic_load(&transformed_people_);
         
-        for(p_it = transformed_people_.begin(); p_it != transformed_people_.end(); ++p_it){
-            people_msgs::Person person = *p_it;
-             
-            double mag = sqrt(pow(person.velocity.x,2) + pow(person.velocity.y, 2));
-            double factor = 1.0 + mag * factor_;
-            double point = get_radius(cutoff_, amplitude_, covar_ * factor );
+        for(unsigned int k=0; k<people->size(); k++){
+            double point = people->radius[k];
               
-            *min_x = std::min(*min_x, person.position.x - point);
-            *min_y = std::min(*min_y, person.position.y - point);
-            *max_x = std::max(*max_x, person.position.x + point);
-            *max_y = std::max(*max_y, person.position.y + point);
+            *min_x = std::min(*min_x, people->x[k] - point);
+            *min_y = std::min(*min_y, people->y[k] - point);
+            *max_x = std::max(*max_x, people->x[k] + point);
+            *max_y = std::max(*max_y, people->y[k] + point);
               
         }
     }
+
+    double ProxemicLayer::footprintRadius(double speed)
+    {
+        boost::shared_ptr<const Parameters> params = boost::atomic_load(&params_);
+        if(!params)
+            return 0.0;
+        return get_radius(params->cutoff, params->amplitude, params->covar * (1.0 + speed * params->factor));
+    }
     
     void ProxemicLayer::updateCosts(costmap_2d::Costmap2D& master_grid, int min_i, int min_j, int max_i, int max_j){
-        boost::recursive_mutex::scoped_lock lock(lock_);
         if(!enabled_) return;
 
-        if( people_list_.people.size() == 0 )
+        boost::shared_ptr<const Parameters> params = boost::atomic_load(&params_);
+        if( !params )
+            return;
+
+        // Rendered against one snapshot, whatever updateBounds() publishes meanwhile
+        boost::shared_ptr<const PersonArrays> people = boost::atomic_load(&transformed_people_);
+        if( !people || people->size() == 0 )
           return;
-        if( cutoff_ >= amplitude_)
+        if( params->cutoff >= params->amplitude)
             return;
         
-        std::list<people_msgs::Person>::iterator p_it;
         costmap_2d::Costmap2D* costmap = layered_costmap_->getCostmap();
-        double res = costmap->getResolution();
-        
-        for(p_it = transformed_people_.begin(); p_it != transformed_people_.end(); ++p_it){
-            people_msgs::Person person = *p_it;
-            double angle = atan2(person.velocity.y, person.velocity.x);
-            double mag = sqrt(pow(person.velocity.x,2) + pow(person.velocity.y, 2));
-            double factor = 1.0 + mag * factor_;
-            double base = get_radius(cutoff_, amplitude_, covar_);
-            double point = get_radius(cutoff_, amplitude_, covar_ * factor );
-            
-            unsigned int width = std::max(1, int( (base + point) / res )),
-                          height = std::max(1, int( (base + point) / res ));
-                          
-            double cx = person.position.x, cy = person.position.y;
-
-            double ox, oy;
-            if(sin(angle)>0)
-                oy = cy - base;
-            else
-                oy = cy + (point-base) * sin(angle) - base;
-
-            if(cos(angle)>=0)
-                ox = cx - base;
-            else
-                ox = cx + (point-base) * cos(angle) - base;
-
-
-            int dx, dy;
-            costmap->worldToMapNoBounds(ox, oy, dx, dy);
-
-            int start_x = 0, start_y=0, end_x=width, end_y = height;
-            if(dx < 0)
-                start_x = -dx;
-            else if(dx + width > costmap->getSizeInCellsX())
-                end_x = std::max(0, (int)costmap->getSizeInCellsX() - dx);
-
-            if((int)(start_x+dx) < min_i)
-                start_x = min_i - dx;
-            if((int)(end_x+dx) > max_i)
-                end_x = max_i - dx;
-
-            if(dy < 0)
-                start_y = -dy;
-            else if(dy + height > costmap->getSizeInCellsY())
-                end_y = std::max(0, (int) costmap->getSizeInCellsY() - dy);
-
-            if((int)(start_y+dy) < min_j)
-                start_y = min_j - dy;
-            if((int)(end_y+dy) > max_j)
-                end_y = max_j - dy;
-
-            double bx = ox + res / 2,
-                   by = oy + res / 2;
-            for(int i=start_x;i<end_x;i++){
-                for(int j=start_y;j<end_y;j++){
-                  unsigned char old_cost = costmap->getCost(i+dx, j+dy);
-                  if(old_cost == costmap_2d::NO_INFORMATION)
-                    continue;
 
-                  double x = bx+i*res, y = by+j*res;
-                  double ma = atan2(y-cy,x-cx);
-                  double diff = angles::shortest_angular_distance(angle, ma);
-                  double a;
-                  if(fabs(diff)<M_PI/2)
-                      a = gaussian(x,y,cx,cy,amplitude_,covar_*factor,covar_,angle);
-                  else
-                      a = gaussian(x,y,cx,cy,amplitude_,covar_,       covar_,0);
+        if(render_pool_.size() > 1 && people->size() > 1){
+            // Bin people into the tiles their footprint overlaps. Tiles are rendered
+            // concurrently; since costs only ever get raised, the order people are
+            // rendered in does not change the result.
+            render_min_i_ = std::max(min_i, 0);
+            render_min_j_ = std::max(min_j, 0);
+            render_max_i_ = std::min(max_i, (int)costmap->getSizeInCellsX());
+            render_max_j_ = std::min(max_j, (int)costmap->getSizeInCellsY());
+            if(render_min_i_ >= render_max_i_ || render_min_j_ >= render_max_j_)
+                return;
+            render_tiles_x_ = (render_max_i_ - render_min_i_ + RENDER_TILE - 1) / RENDER_TILE;
+            int tiles_y = (render_max_j_ - render_min_j_ + RENDER_TILE - 1) / RENDER_TILE;
+            render_tiles_.resize(render_tiles_x_ * tiles_y);
+            for(unsigned int t=0; t<render_tiles_.size(); t++)
+                render_tiles_[t].clear();
 
-                  if(a < cutoff_)
+            for(unsigned int k=0; k<people->size(); k++){
+                // From this pass's parameters, which may be newer than those of the store
+                double point = get_radius(params->cutoff, params->amplitude,
+                                          params->covar * (1.0 + people->speed[k] * params->factor));
+
+                // With a cell of margin for the rounding of the renderers
+                int x0, y0, x1, y1;
+                costmap->worldToMapNoBounds(people->x[k] - point, people->y[k] - point, x0, y0);
+                costmap->worldToMapNoBounds(people->x[k] + point, people->y[k] + point, x1, y1);
+                x0 = std::max(x0 - 1, render_min_i_);
+                y0 = std::max(y0 - 1, render_min_j_);
+                x1 = std::min(x1 + 1, render_max_i_ - 1);
+                y1 = std::min(y1 + 1, render_max_j_ - 1);
+                if(x0 > x1 || y0 > y1)
                     continue;
-                  unsigned char cvalue = (unsigned char) a;
-                  costmap->setCost(i+dx, j+dy, std::max(cvalue, old_cost));
 
-              }
-            } 
+                for(int ty=(y0 - render_min_j_) / RENDER_TILE; ty<=(y1 - render_min_j_) / RENDER_TILE; ty++)
+                    for(int tx=(x0 - render_min_i_) / RENDER_TILE; tx<=(x1 - render_min_i_) / RENDER_TILE; tx++)
+                        render_tiles_[ty * render_tiles_x_ + tx].push_back(k);
+            }
+            render_pool_.run(boost::bind(&ProxemicLayer::renderTiles, this, costmap, params.get(), people.get(), _1, _2));
+            return;
+        }
+
+        for(unsigned int k=0; k<people->size(); k++)
+            renderPerson(*costmap, *params, *people, k, min_i, min_j, max_i, max_j);
+    }
+
+    void ProxemicLayer::renderTiles(costmap_2d::Costmap2D* costmap, const Parameters* params, const PersonArrays* people,
+                                    unsigned int worker, unsigned int workers)
+    {
+        for(unsigned int t=worker; t<render_tiles_.size(); t+=workers){
+            if(render_tiles_[t].empty())
+                continue;
+            int min_i = render_min_i_ + (t % render_tiles_x_) * RENDER_TILE,
+                min_j = render_min_j_ + (t / render_tiles_x_) * RENDER_TILE;
+            int max_i = std::min(min_i + RENDER_TILE, render_max_i_),
+                max_j = std::min(min_j + RENDER_TILE, render_max_j_);
+            for(unsigned int k=0; k<render_tiles_[t].size(); k++)
+                renderPerson(*costmap, *params, *people, render_tiles_[t][k], min_i, min_j, max_i, max_j);
+        }
+    }
+
+    void ProxemicLayer::renderPerson(costmap_2d::Costmap2D& costmap, const Parameters& params,
+                                     const PersonArrays& people, unsigned int k,
+                                     int min_i, int min_j, int max_i, int max_j)
+    {
+        double res = costmap.getResolution();
+        if(params.stamp_cache_size > 0){
+            blitStamp(costmap, *lookupStamp(params, people.speed[k], people.heading[k], res),
+                      people.x[k], people.y[k], min_i, min_j, max_i, max_j);
+            return;
+        }
+
+        double angle = people.heading[k];
+        double factor = 1.0 + people.speed[k] * params.factor;
+        double base = get_radius(params.cutoff, params.amplitude, params.covar);
+        double point = get_radius(params.cutoff, params.amplitude, params.covar * factor);
+        
+        unsigned int width = std::max(1, int( (base + point) / res )),
+                      height = std::max(1, int( (base + point) / res ));
+                      
+        double cx = people.x[k], cy = people.y[k];
+        ProxemicKernel kernel(params.amplitude, angle, params.covar*factor, params.covar, params.covar);
+
+        double ox, oy;
+        if(kernel.sine()>0)
+            oy = cy - base;
+        else
+            oy = cy + (point-base) * kernel.sine() - base;
 
-            
+        if(kernel.cosine()>=0)
+            ox = cx - base;
+        else
+            ox = cx + (point-base) * kernel.cosine() - base;
+
+
+        int dx, dy;
+        costmap.worldToMapNoBounds(ox, oy, dx, dy);
+
+        int start_x = 0, start_y=0, end_x=width, end_y = height;
+        if(dx < 0)
+            start_x = -dx;
+        else if(dx + width > costmap.getSizeInCellsX())
+            end_x = std::max(0, (int)costmap.getSizeInCellsX() - dx);
+
+        if((int)(start_x+dx) < min_i)
+            start_x = min_i - dx;
+        if((int)(end_x+dx) > max_i)
+            end_x = max_i - dx;
+
+        if(dy < 0)
+            start_y = -dy;
+        else if(dy + height > costmap.getSizeInCellsY())
+            end_y = std::max(0, (int) costmap.getSizeInCellsY() - dy);
+
+        if((int)(start_y+dy) < min_j)
+            start_y = min_j - dy;
+        if((int)(end_y+dy) > max_j)
+            end_y = max_j - dy;
+
+        double bx = ox + res / 2,
+               by = oy + res / 2;
+        if(start_x >= end_x)
+            return;
+        unsigned char* grid = costmap.getCharMap();
+        for(int j=start_y;j<end_y;j++){
+            raiseProxemicRow(kernel, true, params.cutoff, bx + start_x*res - cx, by + j*res - cy, res,
+                             grid + costmap.getIndex(start_x+dx, j+dy), end_x - start_x);
+        }
+    }
+
+    boost::shared_ptr<const ProxemicLayer::Stamp> ProxemicLayer::lookupStamp(const Parameters& params, double speed,
+                                                                            double heading, double res)
+    {
+        boost::mutex::scoped_lock lock(stamp_mutex_);
+        // Stamps depend on every parameter
+        if(params.generation != stamp_generation_ || res != stamp_resolution_){
+            stamps_.clear();
+            stamp_index_.clear();
+            stamp_generation_ = params.generation;
+            stamp_resolution_ = res;
+        }
+
+        // Speeds round down, so a stamp never reaches past the footprintRadius() that the
+        // layer bounds and the tile bins are computed from. Standing people all share the
+        // heading atan2(0, 0) = 0.
+        int speed_bin = int(speed / params.stamp_speed_bin);
+        int heading_bin = speed_bin == 0 ? 0 : int(floor(heading / params.stamp_heading_bin + 0.5));
+        std::pair<int, int> bin(speed_bin, heading_bin);
+
+        std::map<std::pair<int, int>, std::list<boost::shared_ptr<Stamp> >::iterator>::iterator found =
+            stamp_index_.find(bin);
+        if(found != stamp_index_.end()){
+            stamps_.splice(stamps_.begin(), stamps_, found->second);
+            return stamps_.front();
+        }
+
+        double mag = speed_bin * params.stamp_speed_bin, angle = heading_bin * params.stamp_heading_bin;
+        double factor = 1.0 + mag * params.factor;
+        ProxemicKernel kernel(params.amplitude, angle, params.covar*factor, params.covar, params.covar);
+
+        stamps_.push_front(boost::shared_ptr<Stamp>(new Stamp()));
+        Stamp& stamp = *stamps_.front();
+        stamp.bin = bin;
+        stamp.radius = int(get_radius(params.cutoff, params.amplitude, params.covar * factor) / res) + 1;
+        unsigned int side = 2 * stamp.radius + 1;
+        stamp.costs.assign(side * side, 0);
+        for(unsigned int j=0;j<side;j++)
+            raiseProxemicRow(kernel, true, params.cutoff, -stamp.radius*res, (int(j)-stamp.radius)*res, res,
+                             &stamp.costs[j*side], side);
+        stamp_index_[bin] = stamps_.begin();
+
+        if(stamps_.size() > params.stamp_cache_size){
+            stamp_index_.erase(stamps_.back()->bin);
+            stamps_.pop_back();
+        }
+        return stamps_.front();
+    }
+
+    void ProxemicLayer::blitStamp(costmap_2d::Costmap2D& costmap, const Stamp& stamp, double x, double y,
+                                  int min_i, int min_j, int max_i, int max_j)
+    {
+        int mx, my;
+        costmap.worldToMapNoBounds(x, y, mx, my);
+
+        int side = 2 * stamp.radius + 1;
+        int start_x = std::max(std::max(0, min_i), mx - stamp.radius),
+            end_x = std::min(std::min((int)costmap.getSizeInCellsX(), max_i), mx + stamp.radius + 1),
+            start_y = std::max(std::max(0, min_j), my - stamp.radius),
+            end_y = std::min(std::min((int)costmap.getSizeInCellsY(), max_j), my + stamp.radius + 1);
+
+        unsigned char* grid = costmap.getCharMap();
+        for(int j=start_y;j<end_y;j++){
+            const unsigned char* costs = &stamp.costs[(j - my + stamp.radius) * side + start_x - mx + stamp.radius];
+            unsigned char* row = grid + costmap.getIndex(0, j);
+            for(int i=start_x;i<end_x;i++, costs++){
+                if(*costs == 0 || row[i] == costmap_2d::NO_INFORMATION)
+                    continue;
+                row[i] = std::max(*costs, row[i]);
+            }
         }
     }
 
     void ProxemicLayer::configure(ProxemicLayerConfig &config, uint32_t level) {
-        cutoff_ = config.cutoff;
-        amplitude_ = config.amplitude;
-        covar_ = config.covariance;
-        factor_ = config.factor;
+        boost::shared_ptr<Parameters> params(new Parameters());
+        params->generation = ++params_generation_;
+        params->cutoff = config.cutoff;
+        params->amplitude = config.amplitude;
+        params->covar = config.covariance;
+        params->factor = config.factor;
+        params->stamp_cache_size = config.stamp_cache_size;
+        params->stamp_speed_bin = config.stamp_speed_bin;
+        params->stamp_heading_bin = config.stamp_heading_bin;
+        boost::atomic_store(&params_, boost::shared_ptr<const Parameters>(params));
+
         people_keep_time_ = ros::Duration(config.keep_time);
         enabled_ = config.enabled;
     }
@@ -17,43 +17,72 @@ namespace social_navigation_layers
         people_sub_ = nh.subscribe("/people", 1, &SocialLayer::peopleCallback, this);
     }
     
-    void SocialLayer::peopleCallback(const people_msgs::People& people) {
-        boost::recursive_mutex::scoped_lock lock(lock_);
-        people_list_ = people;
+    void PersonArrays::clear()
+    {
+        x.clear();
+        y.clear();
+        vx.clear();
+        vy.clear();
+        heading.clear();
+        speed.clear();
+        radius.clear();
+    }
+
+    PersonArrays& SocialLayer::beginPeople()
+    {
+        boost::shared_ptr<PersonArrays>& buffer = people_buffers_[people_buffer_];
+        if(!buffer || !buffer.unique())
+            buffer.reset(new PersonArrays());
+        buffer->clear();
+        return *buffer;
+    }
+
+    void SocialLayer::addPerson(PersonArrays& people, double x, double y, double vx, double vy)
+    {
+        double speed = sqrt(vx*vx + vy*vy);
+        people.x.push_back(x);
+        people.y.push_back(y);
+        people.vx.push_back(vx);
+        people.vy.push_back(vy);
+        people.heading.push_back(atan2(vy, vx));
+        people.speed.push_back(speed);
+        people.radius.push_back(footprintRadius(speed));
+    }
+
+    void SocialLayer::publishPeople()
+    {
+        boost::atomic_store(&transformed_people_, boost::shared_ptr<const PersonArrays>(people_buffers_[people_buffer_]));
+        people_buffer_ ^= 1;
+    }
+
+    void SocialLayer::peopleCallback(const people_msgs::PeopleConstPtr& people) {
+        boost::atomic_store(&people_list_, people);
     }
 
 
     void SocialLayer::updateBounds(double origin_x, double origin_y, double origin_z, double* min_x, double* min_y, double* max_x, double* max_y){
-        boost::recursive_mutex::scoped_lock lock(lock_);
-        
         std::string global_frame = layered_costmap_->getGlobalFrameID();
-        transformed_people_.clear();
+        people_msgs::PeopleConstPtr people_list = boost::atomic_load(&people_list_);
+        PersonArrays& people = beginPeople();
         
-        for(unsigned int i=0; i<people_list_.people.size(); i++){
-            people_msgs::Person& person = people_list_.people[i];
-            people_msgs::Person tpt;
+        for(unsigned int i=0; people_list && i<people_list->people.size(); i++){
+            const people_msgs::Person& person = people_list->people[i];
             geometry_msgs::PointStamped pt, opt;
             
             try{
               pt.point.x = person.position.x;
               pt.point.y = person.position.y;
               pt.point.z = person.position.z;
-              pt.header.frame_id = people_list_.header.frame_id;
+              pt.header.frame_id = people_list->header.frame_id;
               tf_.transformPoint(global_frame, pt, opt);
-              tpt.position.x = opt.point.x;
-              tpt.position.y = opt.point.y;
-              tpt.position.z = opt.point.z;
+              double x = opt.point.x, y = opt.point.y;
 
               pt.point.x += person.velocity.x;
               pt.point.y += person.velocity.y;
               pt.point.z += person.velocity.z;
               tf_.transformPoint(global_frame, pt, opt);
               
-              tpt.velocity.x = opt.point.x - tpt.position.x;
-              tpt.velocity.y = opt.point.y - tpt.position.y;
-              tpt.velocity.z = opt.point.z - tpt.position.z;
-              
-              transformed_people_.push_back(tpt);
+              addPerson(people, x, y, opt.point.x - x, opt.point.y - y);
               
             }
             catch(tf::LookupException& ex) {
@@ -69,6 +98,7 @@ namespace social_navigation_layers
               continue;
             }
         }
+        publishPeople();
         updateBoundsFromPeople(min_x, min_y, max_x, max_y);
         if(first_time_){
             last_min_x_ = *min_x;
@@ -0,0 +1,77 @@
+#include <social_navigation_layers/worker_pool.h>
+#include <boost/bind.hpp>
+
+namespace social_navigation_layers
+{
+    WorkerPool::WorkerPool() : generation_(0), busy_(0), stopping_(false) {}
+
+    WorkerPool::~WorkerPool()
+    {
+        stop();
+    }
+
+    void WorkerPool::start(unsigned int threads)
+    {
+        stop();
+        stopping_ = false;
+        for(unsigned int i=0; i<threads; i++)
+            threads_.push_back(new boost::thread(boost::bind(&WorkerPool::workerLoop, this, i + 1, generation_)));
+    }
+
+    void WorkerPool::stop()
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_all();
+
+        for(unsigned int i=0; i<threads_.size(); i++){
+            threads_[i]->join();
+            delete threads_[i];
+        }
+        threads_.clear();
+    }
+
+    void WorkerPool::run(const Job& job)
+    {
+        unsigned int workers = size();
+        if(workers > 1){
+            boost::mutex::scoped_lock lock(mutex_);
+            job_ = job;
+            busy_ = workers - 1;
+            generation_++;
+        }
+        work_cv_.notify_all();
+
+        job(0, workers);
+
+        if(workers > 1){
+            boost::mutex::scoped_lock lock(mutex_);
+            while(busy_ > 0)
+                done_cv_.wait(lock);
+            job_.clear();
+        }
+    }
+
+    void WorkerPool::workerLoop(unsigned int worker, unsigned long seen)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        for(;;){
+            while(!stopping_ && generation_ == seen)
+                work_cv_.wait(lock);
+            if(stopping_)
+                return;
+            seen = generation_;
+
+            Job job = job_;
+            unsigned int workers = threads_.size() + 1;
+            lock.unlock();
+            job(worker, workers);
+            lock.lock();
+
+            if(--busy_ == 0)
+                done_cv_.notify_one();
+        }
+    }
+};